@@ -0,0 +1,70 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "DeltaEncoder.h"
+#include "ImageConversion.h"
+#include <algorithm>
+
+uint8 *DeltaEncoder::Prepare(const uint32 Size)
+{
+  Current.SetNumUninitialized(Size, false);
+  return Current.GetData();
+}
+
+uint32 DeltaEncoder::Encode(const bool Keyframe, const uint32 Width, const uint32 Height, const uint32 BytesPerPixel, const uint32 TileSize, uint8 *Out)
+{
+  uint32 Written = Current.Num();
+
+  // Without a matching previous image only a complete image can be sent
+  if(Keyframe || Previous.Num() != Current.Num())
+  {
+    FMemory::Memcpy(Out, Current.GetData(), Current.Num());
+  }
+  else
+  {
+    const uint32 TilesX = (Width + TileSize - 1) / TileSize;
+    const uint32 TilesY = (Height + TileSize - 1) / TileSize;
+    const uint32 Stride = Width * BytesPerPixel;
+    uint8 *Mask = Out;
+    uint8 *It = Out + (TilesX * TilesY + 7) / 8;
+    FMemory::Memzero(Mask, It - Mask);
+
+    for(uint32 TileY = 0, Tile = 0; TileY < TilesY; ++TileY)
+    {
+      const uint32 StartY = TileY * TileSize;
+      const uint32 Rows = std::min(TileSize, Height - StartY);
+      for(uint32 TileX = 0; TileX < TilesX; ++TileX, ++Tile)
+      {
+        const uint32 Offset = StartY * Stride + TileX * TileSize * BytesPerPixel;
+        const uint32 RowSize = std::min(TileSize, Width - TileX * TileSize) * BytesPerPixel;
+
+        bool Changed = false;
+        for(uint32 Row = 0; Row < Rows && !Changed; ++Row)
+        {
+          Changed = !ImageConversion::Equal(&Current[Offset + Row * Stride], &Previous[Offset + Row * Stride], RowSize);
+        }
+        if(!Changed)
+        {
+          continue;
+        }
+
+        Mask[Tile / 8] |= 1 << (Tile % 8);
+        for(uint32 Row = 0; Row < Rows; ++Row, It += RowSize)
+        {
+          FMemory::Memcpy(It, &Current[Offset + Row * Stride], RowSize);
+        }
+      }
+    }
+    Written = It - Out;
+  }
+
+  // The current image is the reference for the next one
+  Swap(Previous, Current);
+  return Written;
+}
+
+uint32 DeltaEncoder::MaxSize(const uint32 Width, const uint32 Height, const uint32 BytesPerPixel, const uint32 TileSize)
+{
+  const uint32 Tiles = ((Width + TileSize - 1) / TileSize) * ((Height + TileSize - 1) / TileSize);
+  return Width * Height * BytesPerPixel + (Tiles + 7) / 8;
+}
@@ -0,0 +1,26 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+/**
+ * Encodes an image as the difference to the previous one. The image is split into square tiles and only the
+ * tiles that changed are written. The output starts with a bit mask with one bit per tile (row major, least
+ * significant bit first) followed by the data of all changed tiles in the same order. The rows of a tile are
+ * stored consecutively, tiles at the right and bottom border are cropped to the image.
+ */
+class UNREALVISION_API DeltaEncoder
+{
+private:
+  TArray<uint8> Previous, Current;
+
+public:
+  // Returns the buffer the current image has to be written to
+  uint8 *Prepare(const uint32 Size);
+
+  // Writes the complete current image for keyframes or the changed tiles to Out, returns the number of bytes written.
+  // Out needs space for the complete image plus the bit mask.
+  uint32 Encode(const bool Keyframe, const uint32 Width, const uint32 Height, const uint32 BytesPerPixel, const uint32 TileSize, uint8 *Out);
+
+  // Size of the output in the worst case
+  static uint32 MaxSize(const uint32 Width, const uint32 Height, const uint32 BytesPerPixel, const uint32 TileSize);
+};
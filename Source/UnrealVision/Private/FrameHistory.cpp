@@ -0,0 +1,155 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "FrameHistory.h"
+#include <algorithm>
+
+FrameHistory::FrameHistory(const uint32 MaxFrames, const size_t MaxBytes) : NumSlots(std::max<uint32>(MaxFrames, 1)), WriteEnd(0), Reserved(0), Newest(0)
+{
+  // Not taken from the slab pool, its size classes would round the ring up to the next power of two
+  Ring.Data = static_cast<uint8 *>(FMemory::Malloc(MaxBytes));
+  Ring.Capacity = MaxBytes;
+  Slots = new Slot[NumSlots];
+  for(uint32 I = 0; I < NumSlots; ++I)
+  {
+    Slots[I].Sequence = 0;
+    Slots[I].Position = 0;
+    Slots[I].Timestamp = 0;
+    Slots[I].Size = 0;
+    Slots[I].FrameType = 0;
+  }
+}
+
+FrameHistory::~FrameHistory()
+{
+  delete[] Slots;
+  FMemory::Free(Ring.Data);
+}
+
+void FrameHistory::Add(const uint8 *Packet, const uint32 Size)
+{
+  if(Size > Ring.Capacity)
+  {
+    return;
+  }
+  const PacketBuffer::PacketHeader *Header = reinterpret_cast<const PacketBuffer::PacketHeader *>(Packet);
+
+  // Packets are not split at the end of the ring, the rest is skipped instead
+  uint64_t Position = WriteEnd;
+  const uint64_t Offset = Position % Ring.Capacity;
+  if(Offset + Size > Ring.Capacity)
+  {
+    Position += Ring.Capacity - Offset;
+  }
+  WriteEnd = Position + Size;
+
+  // Readers of older packets detect that their memory is overwritten from now on
+  Reserved.store(WriteEnd);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  Slot &Entry = Slots[Header->FrameNumber % NumSlots];
+  Entry.Sequence.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(Ring.Data + Position % Ring.Capacity, Packet, Size);
+  Entry.Position.store(Position, std::memory_order_relaxed);
+  Entry.Timestamp.store(Header->TimestampCapture, std::memory_order_relaxed);
+  Entry.Size.store(Size, std::memory_order_relaxed);
+  Entry.FrameType.store(Header->FrameType, std::memory_order_relaxed);
+  Entry.Sequence.store(Header->FrameNumber + 1ull, std::memory_order_release);
+  Newest.store(Header->FrameNumber + 1ull, std::memory_order_release);
+}
+
+bool FrameHistory::ReadSlot(const uint32 FrameNumber, uint64_t &Position, uint64_t &Timestamp, uint32 &Size, uint32 &FrameType) const
+{
+  const Slot &Entry = Slots[FrameNumber % NumSlots];
+  const uint64_t Sequence = FrameNumber + 1ull;
+  if(Entry.Sequence.load(std::memory_order_acquire) != Sequence)
+  {
+    return false;
+  }
+  Position = Entry.Position.load(std::memory_order_relaxed);
+  Timestamp = Entry.Timestamp.load(std::memory_order_relaxed);
+  Size = Entry.Size.load(std::memory_order_relaxed);
+  FrameType = Entry.FrameType.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return Entry.Sequence.load(std::memory_order_relaxed) == Sequence && Reserved.load() <= Position + Ring.Capacity;
+}
+
+bool FrameHistory::Get(const uint32 FrameNumber, std::vector<uint8> &Packet) const
+{
+  uint64_t Position, Timestamp;
+  uint32 Size, FrameType;
+  if(!ReadSlot(FrameNumber, Position, Timestamp, Size, FrameType))
+  {
+    return false;
+  }
+
+  Packet.resize(Size);
+  memcpy(Packet.data(), Ring.Data + Position % Ring.Capacity, Size);
+
+  // The copy is only valid if the writer did not reach the packet while copying
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return Reserved.load() <= Position + Ring.Capacity;
+}
+
+void FrameHistory::FindByNumber(const uint32 First, const uint32 Last, std::vector<uint32> &FrameNumbers) const
+{
+  FrameNumbers.clear();
+  const uint64_t End = Newest.load(std::memory_order_acquire);
+  const uint64_t Begin = End > NumSlots ? End - NumSlots : 0;
+  if(First >= End || Last < Begin)
+  {
+    return;
+  }
+
+  uint64_t Position, Timestamp;
+  uint32 Size, FrameType;
+
+  // A delta frame at the start needs all frames back to its keyframe
+  uint64_t Start = std::max<uint64_t>(First, Begin);
+  while(Start > Begin && ReadSlot((uint32)Start, Position, Timestamp, Size, FrameType) && FrameType == PacketBuffer::FrameDelta)
+  {
+    --Start;
+  }
+
+  // Delta frames are skipped until the next keyframe if a frame before them is missing
+  bool Decodable = false;
+  const uint64_t Stop = std::min<uint64_t>(Last + 1ull, End);
+  for(uint64_t Number = Start; Number < Stop; ++Number)
+  {
+    if(!ReadSlot((uint32)Number, Position, Timestamp, Size, FrameType))
+    {
+      Decodable = false;
+      continue;
+    }
+    Decodable = Decodable || FrameType != PacketBuffer::FrameDelta;
+    if(Decodable)
+    {
+      FrameNumbers.push_back((uint32)Number);
+    }
+  }
+}
+
+void FrameHistory::FindByTimestamp(const uint64_t First, const uint64_t Last, std::vector<uint32> &FrameNumbers) const
+{
+  // Timestamps increase with the frame numbers, so the range of numbers is searched first
+  const uint64_t End = Newest.load(std::memory_order_acquire);
+  const uint64_t Begin = End > NumSlots ? End - NumSlots : 0;
+  uint64_t FirstNumber = End, LastNumber = 0;
+  for(uint64_t Number = Begin; Number < End; ++Number)
+  {
+    uint64_t Position, Timestamp;
+    uint32 Size, FrameType;
+    if(ReadSlot((uint32)Number, Position, Timestamp, Size, FrameType) && Timestamp >= First && Timestamp <= Last)
+    {
+      FirstNumber = std::min(FirstNumber, Number);
+      LastNumber = Number;
+    }
+  }
+
+  FrameNumbers.clear();
+  if(FirstNumber <= LastNumber)
+  {
+    FindByNumber((uint32)FirstNumber, (uint32)LastNumber, FrameNumbers);
+  }
+}
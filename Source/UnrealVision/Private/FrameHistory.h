@@ -0,0 +1,60 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "PacketBuffer.h"
+#include <atomic>
+#include <vector>
+
+/**
+ * Keeps copies of the last packets for clients that want frames from the past. Packets are stored one after
+ * another in a ring of bytes with a fixed size, so the memory used is capped. Delta frames are stored as they
+ * are, a query starting at a delta frame starts at the keyframe before it.
+ *
+ * There is a single writer that never waits for readers. Readers copy a packet and check afterwards whether the
+ * writer has overwritten its memory in the meantime, in which case the packet is reported as missing.
+ */
+class UNREALVISION_API FrameHistory
+{
+private:
+  // Position and meta data of a stored packet. Sequence is FrameNumber + 1 and 0 while the slot is written.
+  struct Slot
+  {
+    std::atomic<uint64_t> Sequence;
+    std::atomic<uint64_t> Position;
+    std::atomic<uint64_t> Timestamp;
+    std::atomic<uint32_t> Size;
+    std::atomic<uint32_t> FrameType;
+  };
+
+  // Exactly MaxBytes, so the memory cap holds
+  SlabPool::Slab Ring;
+  Slot *Slots;
+  const uint32 NumSlots;
+  // Position behind the last packet, positions increase monotonically and are mapped into the ring
+  uint64_t WriteEnd;
+  // End of the memory the writer may modify, data before Reserved - Capacity is still valid
+  std::atomic<uint64_t> Reserved;
+  // Frame number of the newest packet + 1, 0 if empty
+  std::atomic<uint64_t> Newest;
+
+  // Reads the meta data of the slot consistently, returns false if it does not contain the frame
+  bool ReadSlot(const uint32 FrameNumber, uint64_t &Position, uint64_t &Timestamp, uint32 &Size, uint32 &FrameType) const;
+
+public:
+  // Keeps up to MaxFrames packets in MaxBytes of memory
+  FrameHistory(const uint32 MaxFrames, const size_t MaxBytes);
+  ~FrameHistory();
+
+  // Stores a complete packet, only called from the writing thread. Packets larger than the ring are dropped.
+  void Add(const uint8 *Packet, const uint32 Size);
+
+  // Copies the packet with the given frame number, returns false if it is not available anymore
+  bool Get(const uint32 FrameNumber, std::vector<uint8> &Packet) const;
+
+  // Returns the numbers of all stored frames with a frame number from First to Last, in order
+  void FindByNumber(const uint32 First, const uint32 Last, std::vector<uint32> &FrameNumbers) const;
+
+  // Returns the numbers of all stored frames captured from First to Last (nanoseconds), in order
+  void FindByTimestamp(const uint64_t First, const uint64_t Last, std::vector<uint32> &FrameNumbers) const;
+};
@@ -0,0 +1,219 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "FrameSource.h"
+#include "PacketBuffer.h"
+#include <algorithm>
+
+// Copies the rows of a mapped staging texture, the rows might be padded and MappedWidth is the stride in pixels
+template<typename T>
+static void CopyMapped(FRHICommandListImmediate &RHICmdList, FTexture2DRHIRef &Staging, T *Data, const uint32 Width, const uint32 Height)
+{
+  void *Mapped = nullptr;
+  int32 MappedWidth = 0, MappedHeight = 0;
+  RHICmdList.MapStagingSurface(Staging, Mapped, MappedWidth, MappedHeight);
+  const T *Rows = reinterpret_cast<const T *>(Mapped);
+  const uint32 CopyWidth = std::min(Width, Staging->GetSizeX());
+  const uint32 CopyHeight = std::min(Height, Staging->GetSizeY());
+  for(uint32 Row = 0; Row < CopyHeight; ++Row)
+  {
+    FMemory::Memcpy(Data + Row * Width, Rows + Row * MappedWidth, CopyWidth * sizeof(T));
+  }
+  RHICmdList.UnmapStagingSurface(Staging);
+}
+
+// Targets are in the same order as the bits of PacketBuffer::StreamFlags
+static uint32 StreamOf(const uint32 Target)
+{
+  return 1u << Target;
+}
+
+RenderTargetSource::RenderTargetSource(UTextureRenderTarget2D *_Color, UTextureRenderTarget2D *_Depth, UTextureRenderTarget2D *_Object)
+  : Head(0), Requested(0)
+{
+  Targets[TargetColor] = _Color;
+  Targets[TargetDepth] = _Depth;
+  Targets[TargetObject] = _Object;
+  for(uint32 i = 0; i < NumSlots; ++i)
+  {
+    Slots[i].Busy = false;
+  }
+}
+
+RenderTargetSource::~RenderTargetSource()
+{
+  Reset();
+}
+
+bool RenderTargetSource::Request(const uint32 Streams)
+{
+  Slot &Current = Slots[(Head + Requested) % NumSlots];
+  if(Current.Busy)
+  {
+    return false;
+  }
+
+  Current.Busy = true;
+  Current.FrameRequested = GFrameCounter;
+  Current.Streams = Streams;
+  for(uint32 i = 0; i < TargetCount; ++i)
+  {
+    Current.Resources[i] = Targets[i]->GameThread_GetRenderTargetResource();
+  }
+  ++Requested;
+
+  ENQUEUE_UNIQUE_RENDER_COMMAND_TWOPARAMETER(CopyToStaging,
+    RenderTargetSource *, Source, this,
+    Slot *, Current, &Current,
+  {
+    Source->CopyToStaging(RHICmdList, *Current);
+  });
+  Current.Fence.BeginFence();
+  return true;
+}
+
+bool RenderTargetSource::Poll(const bool Wait)
+{
+  if(Requested == 0)
+  {
+    return false;
+  }
+
+  Slot &Current = Slots[Head];
+  if(Wait)
+  {
+    Current.Fence.Wait();
+    return true;
+  }
+  // The copies are submitted when the fence is passed, one frame later the GPU is done with them
+  return Current.Fence.IsFenceComplete() && GFrameCounter > Current.FrameRequested + 1;
+}
+
+void RenderTargetSource::Read(const Images &Out, std::function<void()> Done)
+{
+  check(Requested > 0);
+  Slot &Current = Slots[Head];
+  Current.Out = Out;
+  Current.Done = Done;
+  Head = (Head + 1) % NumSlots;
+  --Requested;
+
+  ENQUEUE_UNIQUE_RENDER_COMMAND_TWOPARAMETER(CopyFromStaging,
+    RenderTargetSource *, Source, this,
+    Slot *, Current, &Current,
+  {
+    Source->CopyFromStaging(RHICmdList, *Current);
+  });
+}
+
+void RenderTargetSource::Reset()
+{
+  // Pending reads are finished by the flush, requested frames are just dropped
+  FlushRenderingCommands();
+  for(uint32 i = 0; i < NumSlots; ++i)
+  {
+    Slots[i].Busy = false;
+  }
+  Head = 0;
+  Requested = 0;
+}
+
+void RenderTargetSource::CopyToStaging(FRHICommandListImmediate &RHICmdList, Slot &Current)
+{
+  for(uint32 i = 0; i < TargetCount; ++i)
+  {
+    if(!(Current.Streams & StreamOf(i)))
+    {
+      continue;
+    }
+    FTextureRenderTargetResource *Resource = Current.Resources[i];
+    const FIntPoint Size = Resource->GetSizeXY();
+    FTexture2DRHIRef &Staging = Current.Staging[i];
+    if(!Staging.IsValid() || Staging->GetSizeX() != (uint32)Size.X || Staging->GetSizeY() != (uint32)Size.Y)
+    {
+      FRHIResourceCreateInfo CreateInfo;
+      Staging = RHICreateTexture2D(Size.X, Size.Y, Resource->GetRenderTargetTexture()->GetFormat(), 1, 1, TexCreate_CPUReadback, CreateInfo);
+    }
+    RHICmdList.CopyToResolveTarget(Resource->GetRenderTargetTexture(), Staging, true, FResolveParams());
+  }
+}
+
+void RenderTargetSource::CopyFromStaging(FRHICommandListImmediate &RHICmdList, Slot &Current)
+{
+  const Images &Out = Current.Out;
+  if(Current.Streams & StreamOf(TargetColor))
+  {
+    CopyMapped(RHICmdList, Current.Staging[TargetColor], Out.Color, Out.Width, Out.Height);
+  }
+  if(Current.Streams & StreamOf(TargetDepth))
+  {
+    CopyMapped(RHICmdList, Current.Staging[TargetDepth], Out.Depth, Out.Width, Out.Height);
+  }
+  if(Current.Streams & StreamOf(TargetObject))
+  {
+    CopyMapped(RHICmdList, Current.Staging[TargetObject], Out.Object, Out.Width, Out.Height);
+  }
+
+  // The slot can be requested again before the images are processed
+  std::function<void()> Done;
+  std::swap(Done, Current.Done);
+  Current.Busy = false;
+  Done();
+}
+
+SyntheticSource::SyntheticSource() : Head(0), Requested(0), FrameNumber(0)
+{
+}
+
+bool SyntheticSource::Request(const uint32 _Streams)
+{
+  if(Requested >= MaxRequested)
+  {
+    return false;
+  }
+  Streams[(Head + Requested) % MaxRequested] = _Streams;
+  ++Requested;
+  return true;
+}
+
+bool SyntheticSource::Poll(const bool Wait)
+{
+  return Requested > 0;
+}
+
+void SyntheticSource::Read(const Images &Out, std::function<void()> Done)
+{
+  check(Requested > 0);
+  const uint32 Current = Streams[Head];
+  Head = (Head + 1) % MaxRequested;
+  --Requested;
+  ++FrameNumber;
+
+  for(uint32 Y = 0; Y < Out.Height; ++Y)
+  {
+    const FFloat16 Distance(1.0f + 2.0f * Y / Out.Height);
+    for(uint32 X = 0; X < Out.Width; ++X)
+    {
+      const uint32 Index = Y * Out.Width + X;
+      if(Current & PacketBuffer::StreamColor)
+      {
+        Out.Color[Index] = FColor((uint8)(X + FrameNumber), (uint8)Y, 128, 255);
+      }
+      if(Current & PacketBuffer::StreamDepth)
+      {
+        Out.Depth[Index] = Distance;
+      }
+      if(Current & PacketBuffer::StreamObject)
+      {
+        Out.Object[Index] = FColor(0, 0, 0, 255);
+      }
+    }
+  }
+  Done();
+}
+
+void SyntheticSource::Reset()
+{
+  Head = 0;
+  Requested = 0;
+}
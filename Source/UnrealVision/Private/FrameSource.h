@@ -0,0 +1,118 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "RenderCommandFence.h"
+#include <atomic>
+#include <functional>
+
+/**
+ * Source of the images processed by the actor. Reading a frame is split into requesting it in the tick it was
+ * rendered and reading it once it is available, so the game thread never waits for the GPU. Frames are read in
+ * the order they were requested.
+ */
+class UNREALVISION_API FrameSource
+{
+public:
+  // Destination of the images of one frame, each image has Width * Height pixels
+  struct Images
+  {
+    uint32 Width, Height;
+    FColor *Color;
+    FFloat16 *Depth;
+    FColor *Object;
+  };
+
+  virtual ~FrameSource() {}
+
+  // Starts reading the images given by Streams (PacketBuffer::StreamFlags), the other images are not written.
+  // Returns false if too many frames are requested already.
+  virtual bool Request(const uint32 Streams) = 0;
+
+  // Returns true if the oldest requested frame can be read without waiting. With Wait it blocks until the frame
+  // can be read and only returns false if no frame is requested.
+  virtual bool Poll(const bool Wait) = 0;
+
+  // Copies the oldest requested frame to Out and calls Done afterwards, both might happen on another thread
+  virtual void Read(const Images &Out, std::function<void()> Done) = 0;
+
+  // Drops all requested frames, nothing is written to any images after it returns
+  virtual void Reset() = 0;
+};
+
+/**
+ * Reads the render targets of the capture components. Each request enqueues copies of the requested targets to a
+ * ring of staging textures and a fence. Once the render thread passed the fence and another frame was started, the
+ * GPU is done with the copies as well and the staging textures are mapped and copied on the render thread.
+ */
+class UNREALVISION_API RenderTargetSource : public FrameSource
+{
+private:
+  static const uint32 NumSlots = 3;
+
+  enum Target
+  {
+    TargetColor = 0,
+    TargetDepth,
+    TargetObject,
+    TargetCount
+  };
+
+  struct Slot
+  {
+    // Set by the game thread before the render commands are enqueued
+    FTextureRenderTargetResource *Resources[TargetCount];
+    Images Out;
+    std::function<void()> Done;
+    uint64 FrameRequested;
+    uint32 Streams;
+    FRenderCommandFence Fence;
+
+    // Only accessed on the render thread
+    FTexture2DRHIRef Staging[TargetCount];
+
+    // Set from the request until the images were copied to Out
+    std::atomic<bool> Busy;
+  };
+
+  UTextureRenderTarget2D *Targets[TargetCount];
+  Slot Slots[NumSlots];
+  // Oldest requested slot and the number of requested slots that were not read yet
+  uint32 Head, Requested;
+
+  void CopyToStaging(FRHICommandListImmediate &RHICmdList, Slot &Current);
+  void CopyFromStaging(FRHICommandListImmediate &RHICmdList, Slot &Current);
+
+public:
+  RenderTargetSource(UTextureRenderTarget2D *_Color, UTextureRenderTarget2D *_Depth, UTextureRenderTarget2D *_Object);
+  virtual ~RenderTargetSource();
+
+  virtual bool Request(const uint32 Streams) override;
+  virtual bool Poll(const bool Wait) override;
+  virtual void Read(const Images &Out, std::function<void()> Done) override;
+  virtual void Reset() override;
+};
+
+/**
+ * Generates moving test patterns instead of reading the render targets, so the pipeline also runs without
+ * rendering (e.g. with -nullrhi). Colors are a gradient shifting by one pixel per frame, depth is a plane
+ * slanted from 1 m at the top to 3 m at the bottom and no objects are visible.
+ */
+class UNREALVISION_API SyntheticSource : public FrameSource
+{
+private:
+  static const uint32 MaxRequested = 3;
+
+  // Streams of the requested frames in the order they were requested
+  uint32 Streams[MaxRequested];
+  uint32 Head, Requested;
+  uint32 FrameNumber;
+
+public:
+  SyntheticSource();
+
+  virtual bool Request(const uint32 Streams) override;
+  virtual bool Poll(const bool Wait) override;
+  virtual void Read(const Images &Out, std::function<void()> Done) override;
+  virtual void Reset() override;
+};
@@ -0,0 +1,288 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "ImageConversion.h"
+#include <cmath>
+
+#if PLATFORM_ENABLE_VECTORINTRINSICS && (defined(_M_X64) || defined(__x86_64__) || defined(__SSE2__))
+#define UNREALVISION_SSE2 1
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define UNREALVISION_TARGET_SSSE3
+#else
+#include <cpuid.h>
+#define UNREALVISION_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#else
+#define UNREALVISION_SSE2 0
+#endif
+
+namespace ImageConversion
+{
+#if UNREALVISION_SSE2
+  /* Converts four Float16 values stored in the lower 16 bits of each lane. Exponent and mantissa are shifted into
+   * place and the multiplication with 2^112 corrects the exponent bias, which also handles denormals.
+   * Infinity and NaN get the maximum exponent, the sign is restored at the end.
+   */
+  static inline __m128 HalfToFloat4(const __m128i Half)
+  {
+    const __m128i MaskNoSign = _mm_set1_epi32(0x7FFF);
+    const __m128 Magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+    const __m128i WasInfNaN = _mm_set1_epi32(0x7BFF);
+    const __m128 ExpInfNaN = _mm_castsi128_ps(_mm_set1_epi32(255 << 23));
+
+    const __m128i ExpMant = _mm_and_si128(MaskNoSign, Half);
+    const __m128i Sign = _mm_slli_epi32(_mm_xor_si128(Half, ExpMant), 16);
+    const __m128 Scaled = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(ExpMant, 13)), Magic);
+    const __m128 InfNaN = _mm_and_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(ExpMant, WasInfNaN)), ExpInfNaN);
+    return _mm_or_ps(Scaled, _mm_or_ps(_mm_castsi128_ps(Sign), InfNaN));
+  }
+
+  static inline __m128i LoadHalf4(const FFloat16 *In)
+  {
+    return _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(In)), _mm_setzero_si128());
+  }
+#endif
+
+  // The kernels are inlined into the registry entries, so constant scales are folded into them
+  static FORCEINLINE void HalfToFloatKernel(const FFloat16 *In, float *Out, const uint32 Count, const float Scale)
+  {
+    uint32 i = 0;
+#if UNREALVISION_SSE2
+    const __m128 Factor = _mm_set1_ps(Scale);
+    for(; i + 4 <= Count; i += 4)
+    {
+      _mm_storeu_ps(Out + i, _mm_mul_ps(HalfToFloat4(LoadHalf4(In + i)), Factor));
+    }
+#endif
+    for(; i < Count; ++i)
+    {
+      Out[i] = In[i].GetFloat() * Scale;
+    }
+  }
+
+  static FORCEINLINE void HalfToUInt16Kernel(const FFloat16 *In, uint16 *Out, const uint32 Count, const float Scale)
+  {
+    uint32 i = 0;
+#if UNREALVISION_SSE2
+    const __m128 Factor = _mm_set1_ps(Scale);
+    const __m128 Zero = _mm_setzero_ps();
+    const __m128 Max = _mm_set1_ps(65535.0f);
+    const __m128i Bias = _mm_set1_epi32(32768);
+    const __m128i Flip = _mm_set1_epi16((int16)0x8000);
+    for(; i + 8 <= Count; i += 8)
+    {
+      const __m128 Low = _mm_mul_ps(HalfToFloat4(LoadHalf4(In + i)), Factor);
+      const __m128 High = _mm_mul_ps(HalfToFloat4(LoadHalf4(In + i + 4)), Factor);
+
+      /* Comparisons with NaN are false, so NaN, infinity and values out of range are masked out. The remaining
+       * values are shifted into the signed range, packed and shifted back, since SSE2 only packs signed values.
+       */
+      const __m128i LowValid = _mm_castps_si128(_mm_and_ps(_mm_cmpge_ps(Low, Zero), _mm_cmple_ps(Low, Max)));
+      const __m128i HighValid = _mm_castps_si128(_mm_and_ps(_mm_cmpge_ps(High, Zero), _mm_cmple_ps(High, Max)));
+      const __m128i LowInt = _mm_and_si128(LowValid, _mm_cvtps_epi32(Low));
+      const __m128i HighInt = _mm_and_si128(HighValid, _mm_cvtps_epi32(High));
+      const __m128i Packed = _mm_packs_epi32(_mm_sub_epi32(LowInt, Bias), _mm_sub_epi32(HighInt, Bias));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + i), _mm_xor_si128(Packed, Flip));
+    }
+#endif
+    for(; i < Count; ++i)
+    {
+      const float Value = In[i].GetFloat() * Scale;
+      // Rounds to nearest even like _mm_cvtps_epi32, so the tail matches the vectorized pixels
+      Out[i] = Value >= 0.0f && Value <= 65535.0f ? (uint16)lrintf(Value) : 0;
+    }
+  }
+
+  void HalfToFloat(const FFloat16 *In, float *Out, const uint32 Count, const float Scale)
+  {
+    HalfToFloatKernel(In, Out, Count, Scale);
+  }
+
+  void HalfToUInt16(const FFloat16 *In, uint16 *Out, const uint32 Count, const float Scale)
+  {
+    HalfToUInt16Kernel(In, Out, Count, Scale);
+  }
+
+  // Byte offsets of the channels in FColor
+#if PLATFORM_LITTLE_ENDIAN
+  static const uint32 ChannelB = 0, ChannelG = 1, ChannelR = 2;
+#else
+  static const uint32 ChannelB = 3, ChannelG = 2, ChannelR = 1;
+#endif
+
+  // Drops the alpha channel of 4 byte pixels, C0 to C2 are the input bytes of the output channels
+  template<uint32 C0, uint32 C1, uint32 C2>
+  static void ColorToColor(const void *In, void *Out, const uint32 Count)
+  {
+    const uint8 *itI = static_cast<const uint8 *>(In);
+    uint8 *itO = static_cast<uint8 *>(Out);
+    for(uint32 i = 0; i < Count; ++i, itI += 4, itO += 3)
+    {
+      itO[0] = itI[C0];
+      itO[1] = itI[C1];
+      itO[2] = itI[C2];
+    }
+  }
+
+#if UNREALVISION_SSE2
+  template<uint32 C0, uint32 C1, uint32 C2>
+  UNREALVISION_TARGET_SSSE3 static void ColorToColorSSSE3(const void *In, void *Out, const uint32 Count)
+  {
+    const uint8 *itI = static_cast<const uint8 *>(In);
+    uint8 *itO = static_cast<uint8 *>(Out);
+    const __m128i Shuffle = _mm_setr_epi8(C0, C1, C2, 4 + C0, 4 + C1, 4 + C2, 8 + C0, 8 + C1, 8 + C2, 12 + C0, 12 + C1, 12 + C2, -1, -1, -1, -1);
+    uint32 i = 0;
+    // Each store writes 4 bytes past the 4 converted pixels, they are overwritten by the next ones
+    for(; i + 8 <= Count; i += 4, itI += 16, itO += 12)
+    {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(itO), _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(itI)), Shuffle));
+    }
+    ColorToColor<C0, C1, C2>(itI, itO, Count - i);
+  }
+#endif
+
+  // Scales are given in thousandths, since floats can not be template parameters
+  template<uint32 ScaleMilli>
+  static void DepthToFloat(const void *In, void *Out, const uint32 Count)
+  {
+    HalfToFloatKernel(static_cast<const FFloat16 *>(In), static_cast<float *>(Out), Count, ScaleMilli / 1000.0f);
+  }
+
+  template<uint32 ScaleMilli>
+  static void DepthToUInt16(const void *In, void *Out, const uint32 Count)
+  {
+    HalfToUInt16Kernel(static_cast<const FFloat16 *>(In), static_cast<uint16 *>(Out), Count, ScaleMilli / 1000.0f);
+  }
+
+  template<uint32 BytesPerPixel>
+  static void Copy(const void *In, void *Out, const uint32 Count)
+  {
+    FMemory::Memcpy(Out, In, Count * BytesPerPixel);
+  }
+
+  static bool HasSSSE3()
+  {
+#if UNREALVISION_SSE2
+#ifdef _MSC_VER
+    int Info[4];
+    __cpuid(Info, 1);
+    return (Info[2] & (1 << 9)) != 0;
+#else
+    unsigned int EAX, EBX, ECX, EDX;
+    return __get_cpuid(1, &EAX, &EBX, &ECX, &EDX) && (ECX & bit_SSSE3) != 0;
+#endif
+#else
+    return false;
+#endif
+  }
+
+  class Registry
+  {
+  public:
+    Converter Converters[FormatCount][FormatCount];
+
+    Registry()
+    {
+      FMemory::Memzero(Converters);
+
+      // The depth material already scales the depth to meters
+      Converters[FormatBGRA8][FormatBGR8] = &ColorToColor<ChannelB, ChannelG, ChannelR>;
+      Converters[FormatFloat16][FormatFloat16] = &Copy<sizeof(FFloat16)>;
+      Converters[FormatFloat16][FormatFloat32] = &DepthToFloat<1000>;
+      Converters[FormatFloat16][FormatUInt16] = &DepthToUInt16<1000 * 1000>;
+
+      const bool SSSE3 = HasSSSE3();
+#if UNREALVISION_SSE2
+      if(SSSE3)
+      {
+        Converters[FormatBGRA8][FormatBGR8] = &ColorToColorSSSE3<ChannelB, ChannelG, ChannelR>;
+      }
+#endif
+      OUT_INFO(TEXT("Image conversion: SSE2 %s, SSSE3 %s"), UNREALVISION_SSE2 ? TEXT("yes") : TEXT("no"), SSSE3 ? TEXT("yes") : TEXT("no"));
+    }
+  };
+
+  static const Registry &GetRegistry()
+  {
+    static const Registry Instance;
+    return Instance;
+  }
+
+  void Initialize()
+  {
+    GetRegistry();
+  }
+
+  Converter Find(const PixelFormat In, const PixelFormat Out)
+  {
+    if(In >= FormatCount || Out >= FormatCount)
+    {
+      return nullptr;
+    }
+    return GetRegistry().Converters[In][Out];
+  }
+
+  void DecodeLabels(const FColor *In, const uint32 *Labels, const uint32 NumLabels, uint32 *Out, const uint32 Count)
+  {
+    if(NumLabels == 0)
+    {
+      FMemory::Memzero(Out, Count * sizeof(uint32));
+      return;
+    }
+
+    uint32 i = 0;
+#if UNREALVISION_SSE2 && PLATFORM_LITTLE_ENDIAN
+    /* Masking and range checks are done for four pixels at once, only the table lookups are scalar. Ids out of
+     * range are replaced by 0 for the lookup, so it stays inside the table, and their labels are masked out.
+     * Ids have 24 bits, so the signed comparison works for any number of labels.
+     */
+    const __m128i MaskId = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i Limit = _mm_set1_epi32((int32)(NumLabels < 0x01000000 ? NumLabels : 0x01000000));
+    uint32 Ids[4];
+    for(; i + 4 <= Count; i += 4)
+    {
+      const __m128i Id = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(In + i)), MaskId);
+      const __m128i Valid = _mm_cmplt_epi32(Id, Limit);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(Ids), _mm_and_si128(Id, Valid));
+      const __m128i Label = _mm_setr_epi32(Labels[Ids[0]], Labels[Ids[1]], Labels[Ids[2]], Labels[Ids[3]]);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(Out + i), _mm_and_si128(Label, Valid));
+    }
+#endif
+    for(; i < Count; ++i)
+    {
+      const uint32 Id = In[i].DWColor() & 0x00FFFFFF;
+      Out[i] = Id < NumLabels ? Labels[Id] : 0;
+    }
+  }
+
+  bool Equal(const uint8 *A, const uint8 *B, const uint32 Size)
+  {
+    uint32 i = 0;
+#if UNREALVISION_SSE2
+    // Differences are accumulated and only checked once per 64 bytes
+    for(; i + 64 <= Size; i += 64)
+    {
+      __m128i Diff = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(A + i)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(B + i)));
+      Diff = _mm_or_si128(Diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(A + i + 16)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(B + i + 16))));
+      Diff = _mm_or_si128(Diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(A + i + 32)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(B + i + 32))));
+      Diff = _mm_or_si128(Diff, _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(A + i + 48)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(B + i + 48))));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(Diff, _mm_setzero_si128())) != 0xFFFF)
+      {
+        return false;
+      }
+    }
+    for(; i + 16 <= Size; i += 16)
+    {
+      const __m128i Diff = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(A + i)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(B + i)));
+      if(_mm_movemask_epi8(_mm_cmpeq_epi8(Diff, _mm_setzero_si128())) != 0xFFFF)
+      {
+        return false;
+      }
+    }
+#endif
+    return memcmp(A + i, B + i, Size - i) == 0;
+  }
+}
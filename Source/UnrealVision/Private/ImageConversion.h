@@ -0,0 +1,45 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+/**
+ * Conversion kernels for the image data. They process four values at once using SSE2 where available.
+ * The conversions between the rendered and the transmitted pixel formats are looked up in a registry. Its kernels
+ * are template instantiations for each channel order and scale, the fastest variant for the CPU is selected once
+ * when the module is loaded.
+ */
+namespace ImageConversion
+{
+  enum PixelFormat : uint32
+  {
+    FormatBGRA8 = 0, // FColor as read from the render targets
+    FormatBGR8, // 8 bit colors without alpha
+    FormatFloat16, // Depth in meters as rendered
+    FormatFloat32, // Depth in meters
+    FormatUInt16, // Depth in millimeters, 0 for invalid or out of range values
+    FormatCount
+  };
+
+  // Converts Count pixels from In to Out
+  typedef void(*Converter)(const void *In, void *Out, const uint32 Count);
+
+  // Selects the kernels for this CPU, further calls have no effect.
+  void Initialize();
+
+  // Returns the converter between the formats or nullptr if there is none.
+  Converter Find(const PixelFormat In, const PixelFormat Out);
+
+  // Converts Float16 values to float and multiplies them with Scale.
+  void HalfToFloat(const FFloat16 *In, float *Out, const uint32 Count, const float Scale);
+
+  // Converts Float16 values to uint16 after multiplying them with Scale and rounding. Negative, infinite,
+  // NaN and values that do not fit into 16 bits are set to 0.
+  void HalfToUInt16(const FFloat16 *In, uint16 *Out, const uint32 Count, const float Scale);
+
+  // Decodes the object ids stored in the RGB channels and maps them to their labels. Ids without a label are set
+  // to 0.
+  void DecodeLabels(const FColor *In, const uint32 *Labels, const uint32 NumLabels, uint32 *Out, const uint32 Count);
+
+  // Compares two memory blocks, returns true if they are equal.
+  bool Equal(const uint8 *A, const uint8 *B, const uint32 Size);
+}
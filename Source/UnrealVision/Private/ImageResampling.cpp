@@ -0,0 +1,125 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "ImageResampling.h"
+#include "Async/ParallelFor.h"
+#include <algorithm>
+
+namespace ImageResampling
+{
+  static const uint32 RowsPerTile = 16;
+
+  // Calls Function(OutY) for all output rows, tiles of rows are processed in parallel
+  template<typename FunctionType>
+  static void ForEachRow(const uint32 OutHeight, FunctionType Function)
+  {
+    const int32 NumTiles = (OutHeight + RowsPerTile - 1) / RowsPerTile;
+    ParallelFor(NumTiles, [&](int32 Tile)
+    {
+      const uint32 EndY = std::min<uint32>(OutHeight, (Tile + 1) * RowsPerTile);
+      for(uint32 OutY = Tile * RowsPerTile; OutY < EndY; ++OutY)
+      {
+        Function(OutY);
+      }
+    });
+  }
+
+  void Box(const FColor *In, const uint32 InWidth, const uint32 X, const uint32 Y, const uint32 OutWidth, const uint32 OutHeight,
+           const uint32 Level, FColor *Out)
+  {
+    const uint32 Block = 1 << Level;
+    const uint32 Channels = OutWidth * Block * 4;
+    const uint32 Shift = 2 * Level;
+    const uint32 Rounding = (1 << Shift) >> 1;
+
+    ForEachRow(OutHeight, [&](const uint32 OutY)
+    {
+      // Sums the rows of the block per channel first, the inner loop works on plain bytes and is vectorized
+      TArray<uint32> Sums;
+      Sums.SetNumZeroed(Channels);
+      uint32 *SumIt = Sums.GetData();
+      for(uint32 Row = 0; Row < Block; ++Row)
+      {
+        const uint8 *InRow = reinterpret_cast<const uint8 *>(In + (Y + OutY * Block + Row) * InWidth + X);
+        for(uint32 I = 0; I < Channels; ++I)
+        {
+          SumIt[I] += InRow[I];
+        }
+      }
+
+      FColor *OutRow = Out + OutY * OutWidth;
+      for(uint32 OutX = 0; OutX < OutWidth; ++OutX)
+      {
+        uint32 Sum[4] = {0, 0, 0, 0};
+        const uint32 *BlockIt = SumIt + OutX * Block * 4;
+        for(uint32 I = 0; I < Block * 4; I += 4)
+        {
+          Sum[0] += BlockIt[I];
+          Sum[1] += BlockIt[I + 1];
+          Sum[2] += BlockIt[I + 2];
+          Sum[3] += BlockIt[I + 3];
+        }
+        uint8 *Pixel = reinterpret_cast<uint8 *>(OutRow + OutX);
+        Pixel[0] = (uint8)((Sum[0] + Rounding) >> Shift);
+        Pixel[1] = (uint8)((Sum[1] + Rounding) >> Shift);
+        Pixel[2] = (uint8)((Sum[2] + Rounding) >> Shift);
+        Pixel[3] = (uint8)((Sum[3] + Rounding) >> Shift);
+      }
+    });
+  }
+
+  void Nearest(const FColor *In, const uint32 InWidth, const uint32 X, const uint32 Y, const uint32 OutWidth, const uint32 OutHeight,
+               const uint32 Level, FColor *Out)
+  {
+    const uint32 Block = 1 << Level;
+    const uint32 Center = Block >> 1;
+
+    ForEachRow(OutHeight, [&](const uint32 OutY)
+    {
+      const FColor *InRow = In + (Y + OutY * Block + Center) * InWidth + X + Center;
+      FColor *OutRow = Out + OutY * OutWidth;
+      for(uint32 OutX = 0; OutX < OutWidth; ++OutX)
+      {
+        OutRow[OutX] = InRow[OutX * Block];
+      }
+    });
+  }
+
+  void MinDepth(const FFloat16 *In, const uint32 InWidth, const uint32 X, const uint32 Y, const uint32 OutWidth, const uint32 OutHeight,
+                const uint32 Level, FFloat16 *Out)
+  {
+    const uint32 Block = 1 << Level;
+    const uint32 Columns = OutWidth * Block;
+
+    ForEachRow(OutHeight, [&](const uint32 OutY)
+    {
+      /* Positive Float16 values have the same order as their encoding, so the minimum is computed on uint16.
+       * Invalid depth (0, negative values and NaN) is mapped to 0xFFFF, which is larger than any valid value
+       * including infinity, and back to 0 in the end.
+       */
+      TArray<uint16> Min;
+      Min.Init(0xFFFF, Columns);
+      uint16 *MinIt = Min.GetData();
+      for(uint32 Row = 0; Row < Block; ++Row)
+      {
+        const uint16 *InRow = reinterpret_cast<const uint16 *>(In + (Y + OutY * Block + Row) * InWidth + X);
+        for(uint32 I = 0; I < Columns; ++I)
+        {
+          const uint16 Value = (uint16)(InRow[I] - 1) < 0x7C00 ? InRow[I] : 0xFFFF;
+          MinIt[I] = std::min(MinIt[I], Value);
+        }
+      }
+
+      uint16 *OutRow = reinterpret_cast<uint16 *>(Out + OutY * OutWidth);
+      for(uint32 OutX = 0; OutX < OutWidth; ++OutX)
+      {
+        uint16 Value = 0xFFFF;
+        for(uint32 I = OutX * Block; I < (OutX + 1) * Block; ++I)
+        {
+          Value = std::min(Value, MinIt[I]);
+        }
+        OutRow[OutX] = Value != 0xFFFF ? Value : 0;
+      }
+    });
+  }
+}
@@ -0,0 +1,23 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+/**
+ * Crops and downscales the images read back from the render targets. The region starts at (X, Y) of the input
+ * image and each output pixel covers a block of 2^Level x 2^Level input pixels. Rows are processed in parallel.
+ */
+namespace ImageResampling
+{
+  // Averages the colors of each block
+  void Box(const FColor *In, const uint32 InWidth, const uint32 X, const uint32 Y, const uint32 OutWidth, const uint32 OutHeight,
+           const uint32 Level, FColor *Out);
+
+  // Takes the center pixel of each block, object colors and ids are never mixed
+  void Nearest(const FColor *In, const uint32 InWidth, const uint32 X, const uint32 Y, const uint32 OutWidth, const uint32 OutHeight,
+               const uint32 Level, FColor *Out);
+
+  // Takes the smallest valid depth of each block, so that foreground objects keep their edges. Blocks without a
+  // valid depth are set to 0.
+  void MinDepth(const FFloat16 *In, const uint32 InWidth, const uint32 X, const uint32 Y, const uint32 OutWidth, const uint32 OutHeight,
+                const uint32 Level, FFloat16 *Out);
+}
@@ -0,0 +1,234 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "MulticastSender.h"
+#include "PacketBuffer.h"
+#include <algorithm>
+#include <chrono>
+
+MulticastSender::MulticastSender(const uint32 _BlockSize) : Socket(nullptr), BlockSize(std::min<uint32>(_BlockSize, 0xFFFF)), Running(false),
+  FramesDropped(0), FramesFailed(0), LastFailureWarning(0)
+{
+  Datagram.resize(MaxDatagramSize);
+  ParityData.resize(MaxPayloadSize);
+  ThreadSettings.Cores = 0;
+  ThreadSettings.Priority = 0;
+}
+
+MulticastSender::~MulticastSender()
+{
+  Stop();
+}
+
+bool MulticastSender::Start(const FString &Group, const int32 Port)
+{
+  FIPv4Address GroupIP;
+  if(!FIPv4Address::Parse(Group, GroupIP))
+  {
+    OUT_ERROR(TEXT("Invalid multicast group: %s"), *Group);
+    return false;
+  }
+
+  // Loopback allows receivers on the same host, TTL 1 keeps the packets in the LAN
+  Socket = FUdpSocketBuilder(TEXT("Multicast Socket"))
+           .AsReusable()
+           .WithMulticastLoopback()
+           .WithMulticastTtl(1)
+           .WithSendBufferSize(4 * 1024 * 1024)
+           .Build();
+  if(!Socket)
+  {
+    OUT_ERROR(TEXT("Could not create multicast socket."));
+    return false;
+  }
+
+  GroupAddress = ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->CreateInternetAddr();
+  GroupAddress->SetIp(GroupIP.Value);
+  GroupAddress->SetPort(Port);
+  OUT_INFO(TEXT("Sending packets to multicast group %s."), *GroupAddress->ToString(true));
+
+  Running = true;
+  Thread = std::thread(&MulticastSender::SendLoop, this);
+  return true;
+}
+
+void MulticastSender::Stop()
+{
+  if(Running)
+  {
+    {
+      std::lock_guard<std::mutex> Lock(LockPending);
+      Running = false;
+    }
+    CVPending.notify_one();
+    Thread.join();
+  }
+
+  if(Socket)
+  {
+    Socket->Close();
+    ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(Socket);
+    Socket = nullptr;
+  }
+}
+
+void MulticastSender::Submit(const SlabPool::SharedSlab &Packet)
+{
+  {
+    std::lock_guard<std::mutex> Lock(LockPending);
+    if(Pending)
+    {
+      ++FramesDropped;
+    }
+    Timing.Notify();
+    Pending = Packet;
+  }
+  CVPending.notify_one();
+}
+
+void MulticastSender::SendLoop()
+{
+  ThreadTuning::Apply(TEXT("UVMulticast"), ThreadSettings);
+
+  while(true)
+  {
+    SlabPool::SharedSlab Sending;
+    {
+      std::unique_lock<std::mutex> Lock(LockPending);
+      CVPending.wait(Lock, [this] {return Pending || !Running; });
+      if(!Running)
+      {
+        break;
+      }
+      std::swap(Pending, Sending);
+    }
+    Timing.Woken();
+    // The reference is dropped right after sending, so the slab can be reused for the next packets
+    SendPacket(Sending->Data, reinterpret_cast<const PacketBuffer::PacketHeader *>(Sending->Data)->Size);
+  }
+  Pending.reset();
+
+  if(FramesDropped > 0)
+  {
+    OUT_INFO(TEXT("Multicast dropped %d packets that were replaced before they were sent."), FramesDropped);
+  }
+  if(FramesFailed > 0)
+  {
+    OUT_INFO(TEXT("Multicast could not send %d packets."), FramesFailed);
+  }
+}
+
+void MulticastSender::SendPacket(const uint8 *Packet, const uint32 Size)
+{
+  const uint32 Count = (Size + MaxPayloadSize - 1) / MaxPayloadSize;
+  if(Count > 0xFFFF)
+  {
+    OUT_WARN(TEXT("Packet of %d Bytes is too large for multicast."), Size);
+    return;
+  }
+
+  FragmentHeader *Header = reinterpret_cast<FragmentHeader *>(Datagram.data());
+  uint8 *Payload = Datagram.data() + sizeof(FragmentHeader);
+  Header->Magic = FragmentMagic;
+  Header->FrameNumber = reinterpret_cast<const PacketBuffer::PacketHeader *>(Packet)->FrameNumber;
+  Header->FrameSize = Size;
+  Header->Count = (uint16_t)Count;
+  Header->BlockSize = (uint16_t)BlockSize;
+
+  // Blocks are paced to MaxRate, so that the receivers' socket buffers are not overrun by a whole frame at once
+  const uint32 PaceBlock = BlockSize > 0 ? BlockSize : DefaultPaceBlock;
+  const double Start = FPlatformTime::Seconds();
+  uint64 BytesSent = 0;
+
+  for(uint32 Index = 0; Index < Count; ++Index)
+  {
+    const uint32 Offset = Index * MaxPayloadSize;
+    const uint32 PayloadSize = std::min(MaxPayloadSize, Size - Offset);
+    Header->Index = (uint16_t)Index;
+    Header->Parity = 0;
+    memcpy(Payload, Packet + Offset, PayloadSize);
+    if(!SendDatagram(sizeof(FragmentHeader) + PayloadSize))
+    {
+      SendFailed();
+      return;
+    }
+    BytesSent += sizeof(FragmentHeader) + PayloadSize;
+    if(BlockSize == 0)
+    {
+      if(Index % PaceBlock == PaceBlock - 1)
+      {
+        Pace(Start, BytesSent);
+      }
+      continue;
+    }
+
+    // Accumulating the parity of the block and sending it after its last fragment
+    const uint32 BlockIndex = Index % BlockSize;
+    if(BlockIndex == 0)
+    {
+      std::fill(ParityData.begin(), ParityData.end(), 0);
+    }
+    for(uint32 I = 0; I < PayloadSize; ++I)
+    {
+      ParityData[I] ^= Payload[I];
+    }
+    if(BlockIndex == BlockSize - 1 || Index == Count - 1)
+    {
+      Header->Index = (uint16_t)(Index / BlockSize);
+      Header->Parity = 1;
+      memcpy(Payload, ParityData.data(), MaxPayloadSize);
+      if(!SendDatagram(MaxDatagramSize))
+      {
+        SendFailed();
+        return;
+      }
+      BytesSent += MaxDatagramSize;
+      Pace(Start, BytesSent);
+    }
+  }
+}
+
+void MulticastSender::Pace(const double Start, const uint64 BytesSent)
+{
+  const double Ahead = (double)BytesSent / MaxRate - (FPlatformTime::Seconds() - Start);
+  if(Ahead > 0)
+  {
+    std::this_thread::sleep_for(std::chrono::microseconds((int64)(Ahead * 1000000.0)));
+  }
+}
+
+void MulticastSender::SendFailed()
+{
+  // Stopping aborts waiting for the socket, that is not an error
+  if(!Running)
+  {
+    return;
+  }
+  ++FramesFailed;
+  const double Now = FPlatformTime::Seconds();
+  if(Now - LastFailureWarning >= FailureWarningInterval)
+  {
+    OUT_WARN(TEXT("Could not send multicast packet, %d failed so far."), FramesFailed);
+    LastFailureWarning = Now;
+  }
+}
+
+bool MulticastSender::SendDatagram(const uint32 Size)
+{
+  // The socket is non-blocking, a full send buffer is waited out instead of dropping the rest of the packet
+  const double Start = FPlatformTime::Seconds();
+  while(true)
+  {
+    int32 BytesSent = 0;
+    if(Socket->SendTo(Datagram.data(), Size, BytesSent, *GroupAddress))
+    {
+      return BytesSent == (int32)Size;
+    }
+    if(ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->GetLastErrorCode() != SE_EWOULDBLOCK || !Running
+       || FPlatformTime::Seconds() - Start > SendTimeout)
+    {
+      return false;
+    }
+    Socket->Wait(ESocketWaitConditions::WaitForWrite, FTimespan::FromMilliseconds(WaitTimeoutMs));
+  }
+}
@@ -0,0 +1,93 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "Sockets.h"
+#include "Networking.h"
+#include "SlabPool.h"
+#include "ThreadTuning.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+/**
+ * Sends the packets to a UDP multicast group, so that any number of receivers in the LAN get them with the
+ * bandwidth of one. Each packet is split into datagrams that fit into the MTU, each starting with a
+ * FragmentHeader. Optionally a parity fragment follows each block of BlockSize data fragments. It contains the
+ * XOR of the data fragments of the block (the last one padded with zeros), so a receiver can restore one lost
+ * fragment per block. Receivers drop packets that can not be completed.
+ *
+ * Packets are sent from an own thread, paced to MaxRate. If a new packet arrives before the previous one was
+ * sent, the older one is dropped. Packets are not copied, the sender keeps a reference until it is done with them.
+ */
+class UNREALVISION_API MulticastSender
+{
+public:
+  static const uint32_t FragmentMagic = 0x55564D46; // "FMVU"
+
+  struct FragmentHeader
+  {
+    uint32_t Magic; // Has to be FragmentMagic
+    uint32_t FrameNumber; // Frame number of the packet
+    uint32_t FrameSize; // Size of the complete packet
+    uint16_t Index; // Index of the data fragment or of the block for parity fragments
+    uint16_t Count; // Number of data fragments of the packet
+    uint16_t BlockSize; // Number of data fragments per parity block, 0 without parity fragments
+    uint16_t Parity; // 1 for parity fragments
+  };
+
+  // Datagrams fit into an Ethernet MTU of 1500 Bytes without IP and UDP headers
+  static const uint32 MaxDatagramSize = 1472;
+  static const uint32 MaxPayloadSize = MaxDatagramSize - sizeof(FragmentHeader);
+
+private:
+  // Send rate in Bytes per second the fragments are paced to
+  static constexpr double MaxRate = 100.0 * 1024.0 * 1024.0;
+  // Number of fragments sent between pacing without parity blocks
+  static const uint32 DefaultPaceBlock = 32;
+  // Time a full socket buffer is waited for before the packet is given up
+  static constexpr double SendTimeout = 1.0;
+  static const uint32 WaitTimeoutMs = 10;
+  // Minimum time between warnings about failed packets
+  static constexpr double FailureWarningInterval = 5.0;
+
+  FSocket *Socket;
+  TSharedPtr<FInternetAddr> GroupAddress;
+  const uint32 BlockSize;
+
+  std::thread Thread;
+  volatile bool Running;
+  std::mutex LockPending;
+  std::condition_variable CVPending;
+
+  // Packet waiting to be sent, it is shared with the other senders
+  SlabPool::SharedSlab Pending;
+  uint32 FramesDropped, FramesFailed;
+  double LastFailureWarning;
+
+  std::vector<uint8> Datagram, ParityData;
+
+  void SendLoop();
+  void SendPacket(const uint8 *Packet, const uint32 Size);
+  bool SendDatagram(const uint32 Size);
+  void Pace(const double Start, const uint64 BytesSent);
+  void SendFailed();
+
+public:
+  // BlockSize is the number of data fragments per parity fragment, 0 disables them
+  MulticastSender(const uint32 _BlockSize);
+  ~MulticastSender();
+
+  // Creates the socket for sending to the group and starts the sending thread
+  bool Start(const FString &Group, const int32 Port);
+  void Stop();
+
+  // Queues the packet for sending, called from the writing thread
+  void Submit(const SlabPool::SharedSlab &Packet);
+
+  // Cores and priority of the sending thread, has to be set before Start
+  ThreadTuning::Settings ThreadSettings;
+  // Measures how regularly the sending thread takes packets
+  ThreadTiming Timing;
+};
@@ -0,0 +1,113 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "ObjectStatistics.h"
+#include "Async/ParallelFor.h"
+#include <algorithm>
+
+namespace ObjectStatistics
+{
+  typedef PacketBuffer::ObjectStatsEntry Entry;
+
+  static const uint32 RowsPerTile = 32;
+
+  // Adds the pixels from X0 to X1 (inclusive) in row Y to the object
+  static inline void AddRun(TMap<uint32, Entry> &Objects, const uint32 Id, const uint32 X0, const uint32 X1, const uint32 Y)
+  {
+    Entry *Object = Objects.Find(Id);
+    if(!Object)
+    {
+      Entry NewObject;
+      NewObject.Id = Id;
+      NewObject.Pixels = 0;
+      NewObject.MinX = (uint16)X0;
+      NewObject.MinY = (uint16)Y;
+      NewObject.MaxX = (uint16)X1;
+      NewObject.MaxY = (uint16)Y;
+      Object = &Objects.Add(Id, NewObject);
+    }
+    Object->Pixels += X1 - X0 + 1;
+    Object->MinX = std::min(Object->MinX, (uint16)X0);
+    Object->MaxX = std::max(Object->MaxX, (uint16)X1);
+    Object->MaxY = (uint16)Y;
+  }
+
+  /* ReadId returns the id of a pixel and IsValid tells if an id belongs to an object. Rows are split into runs of
+   * the same id, so the per tile maps are only accessed at object borders.
+   */
+  template<typename ReadIdType, typename IsValidType>
+  static void Compute(const uint32 Width, const uint32 Height, ReadIdType ReadId, IsValidType IsValid, TArray<Entry> &Stats)
+  {
+    const int32 NumTiles = (Height + RowsPerTile - 1) / RowsPerTile;
+    TArray<TMap<uint32, Entry>> TileObjects;
+    TileObjects.SetNum(NumTiles);
+
+    ParallelFor(NumTiles, [&](int32 Tile)
+    {
+      TMap<uint32, Entry> &Objects = TileObjects[Tile];
+      const uint32 EndY = std::min<uint32>(Height, (Tile + 1) * RowsPerTile);
+      for(uint32 Y = Tile * RowsPerTile; Y < EndY; ++Y)
+      {
+        uint32 X = 0;
+        while(X < Width)
+        {
+          const uint32 Id = ReadId(X, Y);
+          uint32 End = X + 1;
+          while(End < Width && ReadId(End, Y) == Id)
+          {
+            ++End;
+          }
+          if(IsValid(Id))
+          {
+            AddRun(Objects, Id, X, End - 1, Y);
+          }
+          X = End;
+        }
+      }
+    });
+
+    // Merging the tiles, they are ordered from top to bottom
+    TMap<uint32, Entry> Objects;
+    for(const TMap<uint32, Entry> &Tile : TileObjects)
+    {
+      for(const auto &Pair : Tile)
+      {
+        Entry *Object = Objects.Find(Pair.Key);
+        if(!Object)
+        {
+          Objects.Add(Pair.Key, Pair.Value);
+          continue;
+        }
+        Object->Pixels += Pair.Value.Pixels;
+        Object->MinX = std::min(Object->MinX, Pair.Value.MinX);
+        Object->MaxX = std::max(Object->MaxX, Pair.Value.MaxX);
+        Object->MaxY = Pair.Value.MaxY;
+      }
+    }
+
+    Stats.Reset(Objects.Num());
+    for(const auto &Pair : Objects)
+    {
+      Stats.Add(Pair.Value);
+    }
+    Stats.Sort([](const Entry &A, const Entry &B) { return A.Id < B.Id; });
+  }
+
+  void FromLabels(const uint32 *Labels, const uint32 Width, const uint32 Height, TArray<Entry> &Stats)
+  {
+    Compute(Width, Height,
+      [Labels, Width](const uint32 X, const uint32 Y) { return Labels[Y * Width + X]; },
+      [](const uint32 Id) { return Id != 0; }, Stats);
+  }
+
+  void FromColors(const uint8 *Image, const uint32 Width, const uint32 Height, const TSet<uint32> &Colors, TArray<Entry> &Stats)
+  {
+    Compute(Width, Height,
+      [Image, Width](const uint32 X, const uint32 Y)
+      {
+        const uint8 *Pixel = Image + (Y * Width + X) * 3;
+        return ((uint32)Pixel[2] << 16) | ((uint32)Pixel[1] << 8) | (uint32)Pixel[0];
+      },
+      [&Colors](const uint32 Id) { return Colors.Contains(Id); }, Stats);
+  }
+}
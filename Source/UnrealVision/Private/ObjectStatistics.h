@@ -0,0 +1,18 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "PacketBuffer.h"
+
+/**
+ * Computes the number of pixels and the bounding box of every object visible in the object image. The image is
+ * split into tiles of rows that are processed in parallel, each tile is only read once.
+ */
+namespace ObjectStatistics
+{
+  // Statistics for a label image, label 0 is ignored. The result is sorted by id.
+  void FromLabels(const uint32 *Labels, const uint32 Width, const uint32 Height, TArray<PacketBuffer::ObjectStatsEntry> &Stats);
+
+  // Statistics for a BGR image, only colors (0x00RRGGBB) contained in Colors are counted. The result is sorted by id.
+  void FromColors(const uint8 *Image, const uint32 Width, const uint32 Height, const TSet<uint32> &Colors, TArray<PacketBuffer::ObjectStatsEntry> &Stats);
+}
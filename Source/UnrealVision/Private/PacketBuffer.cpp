@@ -2,47 +2,37 @@
 
 #include "UnrealVision.h"
 #include "PacketBuffer.h"
+#include "DeltaEncoder.h"
+#include <algorithm>
+#include <cmath>
 
-PacketBuffer::PacketBuffer(const uint32 Width, const uint32 Height, const float FieldOfView) :
-  IsDataReadable(false), SizeHeader(sizeof(PacketHeader)), SizeRGB(Width *Height * 3 * sizeof(uint8)), SizeFloat(Width *Height *sizeof(FFloat16)),
-  OffsetColor(SizeHeader), OffsetDepth(OffsetColor + SizeRGB), OffsetObject(OffsetDepth + SizeFloat), OffsetMap(OffsetObject + SizeRGB),
-  Size(SizeHeader + SizeRGB + SizeFloat + SizeRGB)
-{
-  ReadBuffer.resize(Size + 1024 * 1024);
-  WriteBuffer.resize(Size + 1024 * 1024);
-
-  // Create relative FOV for each axis
-  const float FOVX = Height > Width ? FieldOfView * Width / Height : FieldOfView;
-  const float FOVY = Width > Height ? FieldOfView * Height / Width : FieldOfView;
-
-  // Setting header information that do not change
-  HeaderRead = reinterpret_cast<PacketHeader *>(&ReadBuffer[0]);
-  HeaderRead->Size = Size;
-  HeaderRead->SizeHeader = SizeHeader;
-  HeaderRead->Width = Width;
-  HeaderRead->Height = Height;
-  HeaderRead->FieldOfViewX = FOVX;
-  HeaderRead->FieldOfViewY = FOVY;
-  HeaderWrite = reinterpret_cast<PacketHeader *>(&WriteBuffer[0]);
-  HeaderWrite->Size = Size;
-  HeaderWrite->SizeHeader = SizeHeader;
-  HeaderWrite->Width = Width;
-  HeaderWrite->Height = Height;
-  HeaderWrite->FieldOfViewX = FOVX;
-  HeaderWrite->FieldOfViewY = FOVY;
+PacketBuffer::PacketBuffer(const uint32 _Width, const uint32 _Height, const float _FieldOfView, const ObjectFormat _FormatObject) :
+  ReadyTime(0), IsDataReadable(false), RequestedFormatDepth(DepthFormatFloat16), RequestedFormatNormals(NormalsFormatNone), RequestedDeltaInterval(0),
+  KeyframeRequested(false), RequestedStreams(StreamAll), LayoutSize(0), PosesRequested(false), PosesPending(false), FormatObject(_FormatObject), FieldOfView(_FieldOfView),
+  Width(_Width), Height(_Height), PreviousWidth(0), PreviousHeight(0), PreviousFormatDepth(0), PreviousFormatNormals(0),
+  PreviousFrameType(FrameComplete), FrameNumber(0), FramesSinceKeyframe(0), CapturedStreams(StreamAll), StreamsSinceKeyframe(0), SizeHeader(sizeof(PacketHeader)), OffsetColor(SizeHeader)
+{
+  RequestedRegion.X = RequestedRegion.Y = RequestedRegion.Width = RequestedRegion.Height = RequestedRegion.Level = 0;
+  PreviousRegion = RequestedRegion;
+  WriteBuffer.Data = nullptr;
+  WriteBuffer.Capacity = 0;
+  ReaderTiming = nullptr;
 
-  // Setting the pointers to the data
-  Color = &WriteBuffer[OffsetColor];
-  Depth = &WriteBuffer[OffsetDepth];
-  Object = &WriteBuffer[OffsetObject];
-  Map = &WriteBuffer[OffsetMap];
-  Read = &ReadBuffer[0];
+  // Setting up the layout for the write buffer, each following packet gets its layout in StartWriting
+  UpdateLayout();
 
   IsDataReadable = false;
 }
 
+PacketBuffer::~PacketBuffer()
+{
+  SlabPool::Get().Release(WriteBuffer);
+}
+
 void PacketBuffer::StartWriting(const TMap<FString, uint32> &ObjectToColor, const TArray<FColor> &ObjectColors)
 {
+  UpdateLayout();
+
   uint32_t Count = 0;
   uint32_t MapSize = 0;
   uint8_t *It = Map;
@@ -55,16 +45,8 @@ void PacketBuffer::StartWriting(const TMap<FString, uint32> &ObjectToColor, cons
     const FColor &ObjectColor = ObjectColors[Elem.Value];
 
     // Resize the internal buffer if necessary
-    if(Size + MapSize + ElemSize > WriteBuffer.size())
-    {
-      WriteBuffer.resize(WriteBuffer.size() + 1024 * 1024);
-      // Update pointers
-      Color = &WriteBuffer[OffsetColor];
-      Depth = &WriteBuffer[OffsetDepth];
-      Object = &WriteBuffer[OffsetObject];
-      Map = &WriteBuffer[OffsetMap];
-      HeaderWrite = reinterpret_cast<PacketHeader *>(&WriteBuffer[0]);
-    }
+    ReserveMap(MapSize + ElemSize);
+    It = Map + MapSize;
 
     MapEntry *Entry = reinterpret_cast<MapEntry*>(It);
     Entry->Size = ElemSize;
@@ -83,42 +65,391 @@ void PacketBuffer::StartWriting(const TMap<FString, uint32> &ObjectToColor, cons
   }
   HeaderWrite->MapEntries = Count;
   HeaderWrite->Size = Size + MapSize;
+
+  // Space for the object statistics, so that they can be appended without reallocating
+  ReserveMap(MapSize + Count * sizeof(ObjectStatsEntry));
+}
+
+void PacketBuffer::StartWriting(const TArray<FString> &ObjectNames)
+{
+  UpdateLayout();
+
+  const uint32_t NumIds = ObjectNames.Num();
+  uint32_t NamesSize = 0;
+  for(const FString &Name : ObjectNames)
+  {
+    NamesSize += Name.Len();
+  }
+
+  // Space for the map and the object statistics, so that they can be appended without reallocating
+  const uint32_t MapSize = (NumIds + 1) * sizeof(uint32_t) + NamesSize;
+  ReserveMap(MapSize + NumIds * sizeof(ObjectStatsEntry));
+
+  // Writing the offsets for each id followed by the names
+  uint32_t *Offsets = reinterpret_cast<uint32_t *>(Map);
+  uint8_t *Names = Map + (NumIds + 1) * sizeof(uint32_t);
+  uint32_t Offset = 0;
+  for(uint32_t Id = 0; Id < NumIds; ++Id)
+  {
+    const FString &Name = ObjectNames[Id];
+    const uint32_t NameSize = Name.Len();
+    Offsets[Id] = Offset;
+    if(NameSize > 0)
+    {
+      memcpy(Names + Offset, TCHAR_TO_ANSI(*Name), NameSize);
+    }
+    Offset += NameSize;
+  }
+  Offsets[NumIds] = Offset;
+
+  HeaderWrite->MapEntries = NumIds;
+  HeaderWrite->Size = Size + MapSize;
+}
+
+void PacketBuffer::AppendObjectStats(const TArray<ObjectStatsEntry> &Stats)
+{
+  const uint32_t StatsSize = Stats.Num() * sizeof(ObjectStatsEntry);
+  check(HeaderWrite->Size + StatsSize <= WriteBuffer.Capacity);
+
+  memcpy(WriteBuffer.Data + HeaderWrite->Size, Stats.GetData(), StatsSize);
+  HeaderWrite->ObjectStatsEntries = Stats.Num();
+  HeaderWrite->Size += StatsSize;
+}
+
+void PacketBuffer::SetDepthFormat(const DepthFormat Format)
+{
+  RequestedFormatDepth = Format;
+}
+
+void PacketBuffer::SetNormalsFormat(const NormalsFormat Format)
+{
+  RequestedFormatNormals = Format;
+}
+
+void PacketBuffer::SetRegion(const ImageRegion &Region)
+{
+  std::lock_guard<std::mutex> Lock(LockRegion);
+  RequestedRegion = Region;
+}
+
+void PacketBuffer::SetDeltaEncoding(const uint32 Interval)
+{
+  RequestedDeltaInterval = Interval;
+}
+
+void PacketBuffer::RequestKeyframe()
+{
+  KeyframeRequested = true;
+}
+
+void PacketBuffer::CompactImages(const uint32 SizeDataColor, const uint32 SizeDataDepth, const uint32 SizeDataObject, const uint32 SizeDataNormals)
+{
+  // Images were written at the offsets reserved for complete images, map and statistics are moved as well
+  uint8 *Data = WriteBuffer.Data;
+  const uint32 SizeMap = HeaderWrite->Size - OffsetMap;
+  const uint32 NewOffsetDepth = OffsetColor + SizeDataColor;
+  const uint32 NewOffsetObject = NewOffsetDepth + SizeDataDepth;
+  const uint32 NewOffsetNormals = NewOffsetObject + SizeDataObject;
+  const uint32 NewOffsetMap = NewOffsetNormals + SizeDataNormals;
+  memmove(Data + NewOffsetDepth, Data + OffsetDepth, SizeDataDepth);
+  memmove(Data + NewOffsetObject, Data + OffsetObject, SizeDataObject);
+  memmove(Data + NewOffsetNormals, Data + OffsetNormals, SizeDataNormals);
+  memmove(Data + NewOffsetMap, Data + OffsetMap, SizeMap);
+
+  HeaderWrite->Size = NewOffsetMap + SizeMap;
+  HeaderWrite->SizeImageColor = SizeDataColor;
+  HeaderWrite->SizeImageDepth = SizeDataDepth;
+  HeaderWrite->SizeImageObject = SizeDataObject;
+  HeaderWrite->SizeImageNormals = SizeDataNormals;
+}
+
+void PacketBuffer::SetResolution(const uint32 NewWidth, const uint32 NewHeight)
+{
+  Width = NewWidth;
+  Height = NewHeight;
+}
+
+void PacketBuffer::SetStreams(const uint32 Streams)
+{
+  RequestedStreams = Streams & StreamAll;
+}
+
+uint32 PacketBuffer::GetStreams() const
+{
+  return RequestedStreams;
+}
+
+uint32 PacketBuffer::GetSize() const
+{
+  return LayoutSize;
+}
+
+void PacketBuffer::SetCapturedStreams(const uint32 Streams)
+{
+  CapturedStreams = Streams & StreamAll;
+}
+
+void PacketBuffer::UpdateLayout()
+{
+  const uint32_t FormatDepth = RequestedFormatDepth;
+  const uint32_t FormatNormals = RequestedFormatNormals;
+  const uint32_t DeltaInterval = RequestedDeltaInterval;
+
+  // Fitting the requested region into the captured image, the level is reduced until a block fits into the region
+  ImageRegion Region;
+  {
+    std::lock_guard<std::mutex> Lock(LockRegion);
+    Region = RequestedRegion;
+  }
+  Region.X = std::min(Region.X, Width - 1);
+  Region.Y = std::min(Region.Y, Height - 1);
+  Region.Width = Region.Width == 0 ? Width - Region.X : std::min(Region.Width, Width - Region.X);
+  Region.Height = Region.Height == 0 ? Height - Region.Y : std::min(Region.Height, Height - Region.Y);
+  Region.Level = std::min(Region.Level, MaxLevel);
+  while(Region.Level > 0 && (Region.Width >> Region.Level == 0 || Region.Height >> Region.Level == 0))
+  {
+    --Region.Level;
+  }
+  const uint32 ImageWidth = Region.Width >> Region.Level;
+  const uint32 ImageHeight = Region.Height >> Region.Level;
+  Region.Width = ImageWidth << Region.Level;
+  Region.Height = ImageHeight << Region.Level;
+  const uint32 Pixels = ImageWidth * ImageHeight;
+
+  // Delta frames need a keyframe they refer to with the same layout
+  uint32_t Type = FrameComplete;
+  if(DeltaInterval > 0)
+  {
+    const bool LayoutChanged = Width != PreviousWidth || Height != PreviousHeight || FormatDepth != PreviousFormatDepth ||
+                               FormatNormals != PreviousFormatNormals || memcmp(&Region, &PreviousRegion, sizeof(ImageRegion)) != 0;
+    const bool Requested = KeyframeRequested.exchange(false);
+    if(Requested || LayoutChanged || PreviousFrameType == FrameComplete || ++FramesSinceKeyframe >= DeltaInterval)
+    {
+      Type = FrameKeyframe;
+      FramesSinceKeyframe = 0;
+    }
+    else
+    {
+      Type = FrameDelta;
+    }
+  }
+  PreviousWidth = Width;
+  PreviousHeight = Height;
+  PreviousFormatDepth = FormatDepth;
+  PreviousFormatNormals = FormatNormals;
+  PreviousRegion = Region;
+  PreviousFrameType = Type;
+
+  // Images missing in the keyframe have no previous image in the client, they are sent complete the first time
+  const uint32 Streams = CapturedStreams;
+  uint32 StreamsComplete = 0;
+  if(Type == FrameDelta)
+  {
+    StreamsComplete = Streams & ~StreamsSinceKeyframe;
+    StreamsSinceKeyframe |= Streams;
+  }
+  else
+  {
+    StreamsSinceKeyframe = Streams;
+  }
+
+  const uint32 PixelsColor = Streams & StreamColor ? Pixels : 0;
+  const uint32 PixelsDepth = Streams & StreamDepth ? Pixels : 0;
+  const uint32 PixelsObject = Streams & StreamObject ? Pixels : 0;
+  SizeRGB = PixelsColor * 3 * sizeof(uint8);
+  SizeFloat = PixelsDepth * sizeof(FFloat16);
+  SizeDepth = FormatDepth == DepthFormatFloat32 ? PixelsDepth * sizeof(float) : SizeFloat;
+  SizeObject = FormatObject == ObjectFormatLabel ? PixelsObject * sizeof(uint32) : PixelsObject * 3 * sizeof(uint8);
+  SizeNormals = FormatNormals == NormalsFormatNone ? 0 : PixelsDepth * 3 * (FormatNormals == NormalsFormatInt8 ? sizeof(int8) : sizeof(FFloat16));
+
+  // With delta encoding each image gets space for the worst case, CompactImages removes the gaps
+  const uint32 SizeMask = Type == FrameComplete ? 0 : DeltaEncoder::MaxSize(ImageWidth, ImageHeight, 0, DeltaTileSize);
+  OffsetDepth = OffsetColor + (SizeRGB > 0 ? SizeRGB + SizeMask : 0);
+  OffsetObject = OffsetDepth + (SizeDepth > 0 ? SizeDepth + SizeMask : 0);
+  OffsetNormals = OffsetObject + (SizeObject > 0 ? SizeObject + SizeMask : 0);
+  OffsetMap = OffsetNormals + (SizeNormals > 0 ? SizeNormals + SizeMask : 0);
+  Size = OffsetMap;
+  LayoutSize = Size;
+
+  // The slab only changes if the packet gets larger than its size class, nothing needs to be kept
+  if(Size + MapReserve > WriteBuffer.Capacity)
+  {
+    SlabPool::Get().Release(WriteBuffer);
+    WriteBuffer = SlabPool::Get().Acquire(Size + MapReserve);
+  }
+  UpdatePointers();
+
+  // Create relative FOV for each axis, the field of view covers the longer side and the tangent of the half angle
+  // scales with the side length
+  const float TanLonger = std::tan(FMath::DegreesToRadians(FieldOfView) * 0.5f);
+  const float Longer = (float)std::max(Width, Height);
+  const float FOVX = FMath::RadiansToDegrees(2.0f * std::atan(TanLonger * Width / Longer));
+  const float FOVY = FMath::RadiansToDegrees(2.0f * std::atan(TanLonger * Height / Longer));
+
+  // Setting header information for the current layout
+  HeaderWrite->Size = Size;
+  HeaderWrite->SizeHeader = SizeHeader;
+  HeaderWrite->MapEntries = 0;
+  HeaderWrite->ObjectStatsEntries = 0;
+  HeaderWrite->Width = ImageWidth;
+  HeaderWrite->Height = ImageHeight;
+  HeaderWrite->FieldOfViewX = FOVX;
+  HeaderWrite->FieldOfViewY = FOVY;
+  HeaderWrite->FormatObject = FormatObject;
+  HeaderWrite->FormatDepth = FormatDepth;
+  HeaderWrite->FrameNumber = FrameNumber++;
+  HeaderWrite->FrameType = Type;
+  HeaderWrite->TileSize = DeltaTileSize;
+  HeaderWrite->SizeImageColor = SizeRGB;
+  HeaderWrite->SizeImageDepth = SizeDepth;
+  HeaderWrite->SizeImageObject = SizeObject;
+  HeaderWrite->FormatNormals = FormatNormals;
+  HeaderWrite->SizeImageNormals = SizeNormals;
+  HeaderWrite->CaptureWidth = Width;
+  HeaderWrite->CaptureHeight = Height;
+  HeaderWrite->Region = Region;
+  HeaderWrite->Streams = Streams;
+  HeaderWrite->StreamsComplete = StreamsComplete;
 }
 
-void PacketBuffer::DoneWriting()
+void PacketBuffer::UpdatePointers()
 {
-  // Swapping buffers
+  Color = WriteBuffer.Data + OffsetColor;
+  Depth = WriteBuffer.Data + OffsetDepth;
+  Object = WriteBuffer.Data + OffsetObject;
+  Normals = WriteBuffer.Data + OffsetNormals;
+  Map = WriteBuffer.Data + OffsetMap;
+  HeaderWrite = reinterpret_cast<PacketHeader *>(WriteBuffer.Data);
+}
+
+void PacketBuffer::ReserveMap(const uint32 MapSize)
+{
+  if(Size + MapSize <= WriteBuffer.Capacity)
+  {
+    return;
+  }
+
+  // Only happens if the map grows beyond the reserved space, the header and the map written so far are kept
+  SlabPool::Slab NewBuffer = SlabPool::Get().Acquire(Size + MapSize + MapReserve);
+  memcpy(NewBuffer.Data, WriteBuffer.Data, WriteBuffer.Capacity);
+  SlabPool::Get().Release(WriteBuffer);
+  WriteBuffer = NewBuffer;
+  UpdatePointers();
+}
+
+SlabPool::SharedSlab PacketBuffer::DoneWriting()
+{
+  // The pool returns the slabs the senders are done with, so this does not allocate in the steady state
+  SlabPool::SharedSlab Packet = SlabPool::Get().Share(WriteBuffer);
+  WriteBuffer = SlabPool::Get().Acquire(Packet->Capacity);
+  UpdatePointers();
+
+  // A packet that was not taken yet is replaced by the next one. The reading thread is notified for the timing
+  // before the packet is readable, so it can not take it before the notification time is set.
   LockBuffer.lock();
+  if(ReaderTiming)
+  {
+    ReaderTiming->Notify();
+  }
+  ReadBuffer = Packet;
+  ReadyTime = FPlatformTime::Seconds();
   IsDataReadable = true;
-  WriteBuffer.swap(ReadBuffer);
-  Color = &WriteBuffer[OffsetColor];
-  Depth = &WriteBuffer[OffsetDepth];
-  Object = &WriteBuffer[OffsetObject];
-  Map = &WriteBuffer[OffsetMap];
-  Read = &ReadBuffer[0];
-  HeaderRead = reinterpret_cast<PacketHeader *>(&ReadBuffer[0]);
-  HeaderWrite = reinterpret_cast<PacketHeader *>(&WriteBuffer[0]);
   LockBuffer.unlock();
+
+  // Waking up the reading thread, locking makes sure it is either waiting or checks the flag afterwards
+  LockRead.lock();
+  LockRead.unlock();
+  CVWait.notify_one();
+  return Packet;
+}
+
+void PacketBuffer::AddPose(const PoseRecord &Pose)
+{
+  if(!PosesRequested)
+  {
+    return;
+  }
+
+  LockPoses.lock();
+  if(Poses.size() >= MaxPoses)
+  {
+    Poses.erase(Poses.begin());
+  }
+  Poses.push_back(Pose);
+  PosesPending = true;
+  LockPoses.unlock();
+
+  // Waking up the reading thread, locking makes sure it is either waiting or checks the flag afterwards
+  LockRead.lock();
+  LockRead.unlock();
   CVWait.notify_one();
 }
 
-void PacketBuffer::StartReading()
+void PacketBuffer::SetPoseStream(const bool Enable)
+{
+  PosesRequested = Enable;
+  if(!Enable)
+  {
+    LockPoses.lock();
+    Poses.clear();
+    PosesPending = false;
+    LockPoses.unlock();
+  }
+}
+
+void PacketBuffer::TakePoses(std::vector<PoseRecord> &Out)
+{
+  Out.clear();
+  LockPoses.lock();
+  std::swap(Out, Poses);
+  PosesPending = false;
+  LockPoses.unlock();
+}
+
+bool PacketBuffer::WaitForData(const uint32 TimeoutMs)
 {
-  // Waits until writing is done
   std::unique_lock<std::mutex> WaitLock(LockRead);
-  CVWait.wait(WaitLock, [this] {return IsDataReadable; });
+  const bool Waiting = !IsDataReadable && !PosesPending;
+  CVWait.wait_for(WaitLock, std::chrono::milliseconds(TimeoutMs), [this] {return IsDataReadable || PosesPending; });
+  if(!IsDataReadable)
+  {
+    return false;
+  }
 
-  LockBuffer.lock();
+  // Only waking up for a packet counts for the wake-up latency, not finding one after sending the previous one
+  if(ReaderTiming)
+  {
+    if(Waiting)
+    {
+      ReaderTiming->Woken();
+    }
+    else
+    {
+      ReaderTiming->Skip();
+    }
+  }
+  return true;
 }
 
-void PacketBuffer::DoneReading()
+bool PacketBuffer::TakePacket(SlabPool::SharedSlab &Packet, double &PacketReadyTime)
 {
+  std::lock_guard<std::mutex> Lock(LockBuffer);
+  if(!IsDataReadable)
+  {
+    return false;
+  }
+
+  // The previous packet goes back to the pool once no other sender uses it
+  Packet = std::move(ReadBuffer);
+  ReadBuffer.reset();
+  PacketReadyTime = ReadyTime;
   IsDataReadable = false;
-  LockBuffer.unlock();
+  return true;
 }
 
 void PacketBuffer::Release()
 {
-  IsDataReadable = true;
+  LockRead.lock();
+  LockRead.unlock();
   CVWait.notify_one();
 }
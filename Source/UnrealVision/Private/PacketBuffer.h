@@ -2,15 +2,19 @@
 
 #pragma once
 
+#include "SlabPool.h"
+#include "ThreadTuning.h"
 #include <mutex>
-#include <vector>
+#include <atomic>
 #include <condition_variable>
+#include <vector>
 
 /**
  * This is a double buffer, one for reading and one for writing. When writing is done they will be swapped.
- * It also acts as the connection between VisionActor and Server. The StartReading method is blocking until
- * the DoneWriting method is called. So when the VisionActor is done writing, the StartReading methods returns
- * and the Server will start reading and sending the packet.
+ * It also acts as the connection between VisionActor and Server. The WaitForData method is blocking until
+ * the DoneWriting method is called. The Server then takes the completed packet with TakePacket in exchange for
+ * the slab of the packet it sent before, so it can send it for as long as needed without blocking the writer.
+ * Packets completed while the Server is still sending replace each other, only the newest one is taken.
  */
 class UNREALVISION_API PacketBuffer
 {
@@ -19,10 +23,117 @@ public:
    * packet format:
    * - PacketHeader
    * - Color image data (width * height * 3 Bytes (BGR))
-   * - Depth image data (width * height * 2 Bytes (Float16))
-   * - Object image data (width * height * 3 Bytes (BGR))
-   * - List of map entries
+   * - Depth image data (width * height * 2 Bytes (Float16 or uint16_t) or width * height * 4 Bytes (float))
+   * - Object image data (width * height * 3 Bytes (BGR) or width * height * 4 Bytes (uint32_t label))
+   * - Normals image data if requested (width * height * 3 Bytes (int8_t XYZ) or width * height * 6 Bytes (Float16 XYZ))
+   * - List of map entries or the id table for labels
+   * - List of object statistics (ObjectStatsEntries * 16 Bytes)
+   *
+   * The id table starts with MapEntries + 1 uint32_t offsets followed by all names (no trailing '\0').
+   * The name of id i is given by the characters from offset i to offset i + 1 relative to the first name.
+   * Unused ids have an empty name, id 0 is reserved for pixels without an object.
+   *
+   * The object statistics contain an entry for every object visible in the object image, sorted by id.
+   *
+   * All images cover the region of interest of the captured image given in the header. Each pixel covers a block of
+   * 2^Level x 2^Level captured pixels, color is averaged, the object image uses the center pixel and depth the
+   * smallest valid depth of the block. The field of view refers to the captured image.
+   *
+   * If requested, pose records are sent between the packets at the tick rate. They start with their size followed
+   * by PoseMagic in place of SizeHeader. The Sequence of a packet header is the one of the pose record of the same tick.
+   *
+   * With batching, small packets and pose records are collected and sent together, the stream stays the same.
+   * TimestampSent of batched packets is the time they were added to the batch.
+   *
+   * In delta frames the image data only contains the tiles that changed since the previous frame, see DeltaEncoder.
+   * The size of each image data is given in the header. Delta frames are only sent if the previous frame was sent.
+   *
+   * Each image is captured at its own rate, Streams tells which images a packet contains. The data of the others
+   * is left out and their size is 0, normals are only sent with depth. An image that was missing in the keyframe
+   * is sent complete the first time it is contained in a delta frame, StreamsComplete tells which ones are.
+   */
+
+  enum ObjectFormat : uint32_t
+  {
+    ObjectFormatColor = 0, // BGR colors, map entries contain the color of each object
+    ObjectFormatLabel = 1 // Object ids, map contains the id table
+  };
+
+  enum DepthFormat : uint32_t
+  {
+    DepthFormatFloat16 = 0, // Float16 in meters as rendered
+    DepthFormatFloat32 = 1, // float in meters (32FC1)
+    DepthFormatUInt16 = 2 // uint16_t in millimeters (16UC1), 0 for invalid or out of range values
+  };
+
+  enum NormalsFormat : uint32_t
+  {
+    NormalsFormatNone = 0, // No normals image
+    NormalsFormatInt8 = 1, // Unit normals scaled by 127 (8SC3)
+    NormalsFormatFloat16 = 2 // Unit normals as Float16 (16FC3)
+  };
+
+  enum FrameType : uint32_t
+  {
+    FrameComplete = 0, // Complete images, delta encoding is disabled
+    FrameKeyframe = 1, // Complete images, following delta frames refer to it
+    FrameDelta = 2 // Only the tiles that changed since the previous frame
+  };
+
+  enum StreamFlags : uint32_t
+  {
+    StreamColor = 1, // Color image
+    StreamDepth = 2, // Depth image and normals
+    StreamObject = 4, // Object image and statistics
+    StreamAll = StreamColor | StreamDepth | StreamObject
+  };
+
+  // Size of the tiles for delta encoding in pixels
+  static const uint32_t DeltaTileSize = 32;
+
+  // Highest pyramid level, images are downscaled by 2^Level
+  static const uint32_t MaxLevel = 4;
+
+  enum HistoryQuery : uint32_t
+  {
+    HistoryNone = 0, // No past frames requested
+    HistoryByNumber = 1, // Frames with a frame number from HistoryFirst to HistoryLast
+    HistoryByTimestamp = 2 // Frames captured from HistoryFirst to HistoryLast (nanoseconds)
+  };
+
+  // Region of interest in captured pixels and pyramid level of the images
+  struct ImageRegion
+  {
+    uint32_t X;
+    uint32_t Y;
+    uint32_t Width; // 0 for the whole width
+    uint32_t Height; // 0 for the whole height
+    uint32_t Level;
+  };
+
+  /**
+   * Clients can send requests at any time to change the settings of the following packets.
+   * Size allows to add fields at the end, missing fields are set to their defaults.
    */
+  struct ClientRequest
+  {
+    uint32_t Magic; // Has to be RequestMagic
+    uint32_t Size; // Size of the complete request
+    uint32_t FormatDepth; // Requested depth format
+    uint32_t DeltaInterval; // Send a keyframe every DeltaInterval frames and delta frames in between, 0 disables delta encoding
+    uint32_t Keyframe; // Request a keyframe if not 0
+    uint32_t FormatNormals; // Requested normals format, no normals are computed for NormalsFormatNone
+    ImageRegion Region; // Requested region of interest and pyramid level, all 0 for the complete images
+    uint32_t History; // Requests past frames, they are sent before the next packet
+    uint64_t HistoryFirst; // First frame number or timestamp
+    uint64_t HistoryLast; // Last frame number or timestamp
+    uint32_t Poses; // Send a pose record every tick if not 0
+    uint32_t Streams; // Images to capture and send (StreamFlags), 0 for pose records only
+    uint32_t BatchSize; // Packets up to this size are collected until this many bytes, 0 disables batching
+    uint32_t BatchDelay; // Longest time in microseconds data waits in a batch before it is sent anyway
+  };
+
+  static const uint32_t RequestMagic = 0x55565251; // "QRVU"
 
   struct Vector
   {
@@ -39,6 +150,18 @@ public:
     float W;
   };
 
+  static const uint32_t PoseMagic = 0x55565050; // "PPVU"
+
+  struct PoseRecord
+  {
+    uint32_t Size; // Size of the pose record
+    uint32_t Magic; // Always PoseMagic, distinguishes it from a packet
+    uint64_t Sequence; // Number of the tick
+    uint64_t Timestamp; // Timestamp of the tick
+    Vector Translation; // Translation of the camera
+    Quaternion Rotation; // Rotation of the camera
+  };
+
   struct PacketHeader
   {
     uint32_t Size; // Size of the complete packet
@@ -52,6 +175,23 @@ public:
     float FieldOfViewY; // FOV in Y dircetion
     Vector Translation; // Translation of the camera for current frame
     Quaternion Rotation; // Rotation of the camera for current frame
+    uint32_t FormatObject; // Format of the object image
+    uint32_t FormatDepth; // Format of the depth image
+    uint32_t ObjectStatsEntries; // Number of object statistics after the map
+    uint32_t FrameNumber; // Number of the packet, increased by one for each packet
+    uint32_t FrameType; // Complete, keyframe or delta frame
+    uint32_t TileSize; // Size of the tiles for delta frames
+    uint32_t SizeImageColor; // Size of the color image data
+    uint32_t SizeImageDepth; // Size of the depth image data
+    uint32_t SizeImageObject; // Size of the object image data
+    uint32_t FormatNormals; // Format of the normals image
+    uint32_t SizeImageNormals; // Size of the normals image data, 0 if no normals are sent
+    uint32_t CaptureWidth; // Width of the captured image
+    uint32_t CaptureHeight; // Height of the captured image
+    ImageRegion Region; // Region of the captured image covered by the images, Width = Width * 2^Level
+    uint64_t Sequence; // Number of the tick the images were captured in, same as in the pose records
+    uint32_t Streams; // Images contained in the packet (StreamFlags)
+    uint32_t StreamsComplete; // Images sent complete in a delta frame, because they were missing in the keyframe
   };
 
   struct MapEntry
@@ -63,40 +203,143 @@ public:
     char FirstChar; // Position of the first character, Size - 7 Bytes in total
   };
 
+  struct ObjectStatsEntry
+  {
+    uint32_t Id; // Label of the object or its color (0x00RRGGBB) for color object images
+    uint32_t Pixels; // Number of pixels of the object
+    uint16_t MinX; // Bounding box in pixels, including the max values
+    uint16_t MinY;
+    uint16_t MaxX;
+    uint16_t MaxY;
+  };
+
 
 private:
-  std::vector<uint8> ReadBuffer, WriteBuffer;
-  bool IsDataReadable;
+  // Additional space for the map entries reserved with each slab
+  static const uint32 MapReserve = 1024 * 1024;
+  // Pose records kept if the server does not send them, older ones are dropped
+  static const uint32 MaxPoses = 1024;
+
+  SlabPool::Slab WriteBuffer;
+  // Newest completed packet that was not taken by the server yet
+  SlabPool::SharedSlab ReadBuffer;
+  // Time ReadBuffer was completed in seconds
+  double ReadyTime;
+  std::atomic<bool> IsDataReadable;
   std::mutex LockBuffer, LockRead;
   std::condition_variable CVWait;
+  std::atomic<uint32_t> RequestedFormatDepth, RequestedFormatNormals, RequestedDeltaInterval;
+  std::atomic<bool> KeyframeRequested;
+  std::atomic<uint32_t> RequestedStreams;
+  // Copy of Size for other threads
+  std::atomic<uint32_t> LayoutSize;
+  std::mutex LockRegion;
+  ImageRegion RequestedRegion, PreviousRegion;
+  std::mutex LockPoses;
+  std::vector<PoseRecord> Poses;
+  std::atomic<bool> PosesRequested, PosesPending;
+  const ObjectFormat FormatObject;
+  const float FieldOfView;
+  uint32 Width, Height;
+  // Layout of the previous packet, a change requires a new keyframe
+  uint32 PreviousWidth, PreviousHeight, PreviousFormatDepth, PreviousFormatNormals, PreviousFrameType;
+  uint32 FrameNumber, FramesSinceKeyframe;
+  // Images of the next packet and the images sent since the last keyframe
+  uint32 CapturedStreams, StreamsSinceKeyframe;
+
+  // Applies the requested resolution and formats to the layout of the write buffer
+  void UpdateLayout();
+
+  // Updates the pointers to the data of the write buffer
+  void UpdatePointers();
+
+  // Makes sure the map fits into the write buffer
+  void ReserveMap(const uint32 MapSize);
 
 public:
-  // Sizes of the Header, the raw color and depth image data
-  const uint32 SizeHeader, SizeRGB, SizeFloat;
+  // Sizes of the Header, the raw color, depth, object and normals image data of the current write buffer
+  const uint32 SizeHeader;
+  uint32 SizeRGB, SizeFloat, SizeObject, SizeDepth, SizeNormals;
   // Offsets for the images and map entries in the packet buffer
-  const uint32 OffsetColor, OffsetDepth, OffsetObject, OffsetMap;
-  // Size of the complete packet
-  const uint32 Size;
-  // Pointers to the beginning of the images and map for writing and a pointer to the beginning of a completed packet for reading
-  uint8 *Color, *Depth, *Object, *Map, *Read;
-  // Pointer to the packet headers
-  PacketHeader *HeaderWrite, *HeaderRead;
+  const uint32 OffsetColor;
+  uint32 OffsetDepth, OffsetObject, OffsetNormals, OffsetMap;
+  // Size of the complete packet without map, only for the writing thread
+  uint32 Size;
+  // Pointers to the beginning of the images and map for writing
+  uint8 *Color, *Depth, *Object, *Normals, *Map;
+  // Pointer to the packet header for writing
+  PacketHeader *HeaderWrite;
+  // Optional, measures how fast the reading thread wakes up for new packets. Has to be set before it starts.
+  ThreadTiming *ReaderTiming;
 
-  // Initializes the buffer, widht and height are not changeable afterwards
-  PacketBuffer(const uint32 Width, const uint32 Height, const float FieldOfView);
+  // Initializes the buffer, the object format is not changeable afterwards
+  PacketBuffer(const uint32 _Width, const uint32 _Height, const float _FieldOfView, const ObjectFormat _FormatObject = ObjectFormatColor);
+
+  // Returns the slabs to the pool
+  ~PacketBuffer();
 
   // Starts writing and copies the map entries to the end of the packet.
   void StartWriting(const TMap<FString, uint32> &ObjectToColor, const TArray<FColor> &ObjectColors);
 
-  // Swaps reading and writing buffer and unblocks the reading thread
-  void DoneWriting();
+  // Starts writing and copies the id table to the end of the packet. The index of the array is the id.
+  void StartWriting(const TArray<FString> &ObjectNames);
+
+  // Appends the object statistics after the map. StartWriting reserves space for one entry per known object.
+  void AppendObjectStats(const TArray<ObjectStatsEntry> &Stats);
+
+  // Moves the image data of delta frames together, sizes are the number of bytes written to each image
+  void CompactImages(const uint32 SizeDataColor, const uint32 SizeDataDepth, const uint32 SizeDataObject, const uint32 SizeDataNormals);
+
+  // Sets the depth format for the next packets, can be called from any thread
+  void SetDepthFormat(const DepthFormat Format);
+
+  // Sets the normals format for the next packets, can be called from any thread
+  void SetNormalsFormat(const NormalsFormat Format);
+
+  // Sets the region of interest and pyramid level for the next packets, can be called from any thread
+  void SetRegion(const ImageRegion &Region);
+
+  // Enables delta encoding with a keyframe every Interval frames or disables it for 0, can be called from any thread
+  void SetDeltaEncoding(const uint32 Interval);
+
+  // Makes the next packet a keyframe, can be called from any thread
+  void RequestKeyframe();
+
+  // Sets the resolution for the next packets. Has to be called from the writing thread before StartWriting.
+  void SetResolution(const uint32 NewWidth, const uint32 NewHeight);
+
+  // Sets the images the client wants to receive (StreamFlags), can be called from any thread
+  void SetStreams(const uint32 Streams);
+
+  // Returns the images the client wants to receive, only those are captured unless other consumers need all
+  uint32 GetStreams() const;
+
+  // Returns the size of the current packet layout without map, can be called from any thread
+  uint32 GetSize() const;
+
+  // Sets the images contained in the next packet. Has to be called from the writing thread before StartWriting.
+  void SetCapturedStreams(const uint32 Streams);
+
+  // Completes the packet and unblocks the reading thread. The returned packet is shared with the server, the
+  // writer continues with a new slab.
+  SlabPool::SharedSlab DoneWriting();
+
+  // Queues a pose record for sending if a client requested them, called from the game thread
+  void AddPose(const PoseRecord &Pose);
+
+  // Enables or disables queuing pose records, can be called from any thread
+  void SetPoseStream(const bool Enable);
+
+  // Moves all queued pose records to Out
+  void TakePoses(std::vector<PoseRecord> &Out);
 
-  // Waits until the reading buffer is valid and locks it.
-  void StartReading();
+  // Waits up to TimeoutMs until a packet or pose records are available, returns true if a packet is readable
+  bool WaitForData(const uint32 TimeoutMs);
 
-  // Unlocks the reading buffer
-  void DoneReading();
+  // Replaces Packet with the newest completed packet, returns false if there is none. Each packet is only
+  // taken once. PacketReadyTime is set to the time the packet was completed.
+  bool TakePacket(SlabPool::SharedSlab &Packet, double &PacketReadyTime);
 
-  // Releases the lock so that StartReading will return, this is needed to stop the server in the end.
+  // Wakes up WaitForData, this is needed to stop the server in the end.
   void Release();
 };
@@ -0,0 +1,113 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "PacketRecorder.h"
+#include "PacketBuffer.h"
+
+PacketRecorder::PacketRecorder() : PacketsWritten(0), Recording(false), Running(false)
+{
+}
+
+PacketRecorder::~PacketRecorder()
+{
+  Close();
+}
+
+bool PacketRecorder::Open(const FString &Path)
+{
+  Close();
+  FileBuffer.resize(FileBufferSize);
+  File.rdbuf()->pubsetbuf(FileBuffer.data(), FileBuffer.size());
+  File.open(TCHAR_TO_UTF8(*Path), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+  if(!File.is_open())
+  {
+    OUT_ERROR(TEXT("Could not open recording file: %s"), *Path);
+    return false;
+  }
+  OUT_INFO(TEXT("Recording packets to %s"), *Path);
+  PacketsWritten = 0;
+
+  Recording = true;
+  Running = true;
+  Thread = std::thread(&PacketRecorder::WriteLoop, this);
+  return true;
+}
+
+bool PacketRecorder::IsOpen() const
+{
+  return Recording;
+}
+
+void PacketRecorder::Submit(const SlabPool::SharedSlab &Packet)
+{
+  if(!Recording)
+  {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> Lock(LockQueue);
+    CVQueue.wait(Lock, [this] {return Queue.size() < MaxQueued || !Recording; });
+    if(!Recording)
+    {
+      return;
+    }
+    Queue.push_back(Packet);
+  }
+  CVQueue.notify_all();
+}
+
+void PacketRecorder::WriteLoop()
+{
+  FPlatformProcess::SetThreadName(TEXT("UVRecorder"));
+
+  while(true)
+  {
+    SlabPool::SharedSlab Packet;
+    {
+      std::unique_lock<std::mutex> Lock(LockQueue);
+      CVQueue.wait(Lock, [this] {return !Queue.empty() || !Running; });
+      // Packets queued before closing are still written
+      if(Queue.empty())
+      {
+        break;
+      }
+      Packet = Queue.front();
+      Queue.pop_front();
+    }
+    CVQueue.notify_all();
+
+    File.write(reinterpret_cast<const char *>(Packet->Data), reinterpret_cast<const PacketBuffer::PacketHeader *>(Packet->Data)->Size);
+    if(!File.good())
+    {
+      OUT_ERROR(TEXT("Could not write to recording file, stopping recording after %llu packets."), PacketsWritten);
+      {
+        std::lock_guard<std::mutex> Lock(LockQueue);
+        Recording = false;
+        Queue.clear();
+      }
+      CVQueue.notify_all();
+      break;
+    }
+    ++PacketsWritten;
+  }
+}
+
+void PacketRecorder::Close()
+{
+  if(Thread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> Lock(LockQueue);
+      Running = false;
+    }
+    CVQueue.notify_all();
+    Thread.join();
+  }
+  Recording = false;
+
+  if(File.is_open())
+  {
+    File.close();
+    OUT_INFO(TEXT("Recording closed after %llu packets."), PacketsWritten);
+  }
+}
@@ -0,0 +1,59 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "SlabPool.h"
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/**
+ * Writes completed packets to a file. The packets are stored one after another in the same format they are sent
+ * to clients, so a recording can be read like the stream of the server.
+ *
+ * Packets are written from an own thread, the writing thread only queues a reference to them. A recording must not
+ * miss packets, so if the disk falls behind by MaxQueued packets, queuing waits for the file writes instead of
+ * dropping them.
+ */
+class UNREALVISION_API PacketRecorder
+{
+private:
+  // Size of the file buffer, large packets are written directly
+  static const size_t FileBufferSize = 4 * 1024 * 1024;
+  // Number of packets waiting to be written before Submit blocks
+  static const size_t MaxQueued = 8;
+
+  std::ofstream File;
+  std::vector<char> FileBuffer;
+  uint64 PacketsWritten;
+
+  std::thread Thread;
+  std::atomic<bool> Recording;
+  bool Running;
+  std::mutex LockQueue;
+  std::condition_variable CVQueue;
+  // Packets waiting to be written, they are shared with the senders
+  std::deque<SlabPool::SharedSlab> Queue;
+
+  void WriteLoop();
+
+public:
+  PacketRecorder();
+  ~PacketRecorder();
+
+  // Creates the file, an existing file is overwritten, and starts the writing thread
+  bool Open(const FString &Path);
+
+  // False if the recording is closed or stopped after a write error
+  bool IsOpen() const;
+
+  // Queues the packet for writing, called from the writing thread
+  void Submit(const SlabPool::SharedSlab &Packet);
+
+  // Writes the queued packets, then flushes and closes the file
+  void Close();
+};
@@ -3,9 +3,22 @@
 #include "UnrealVision.h"
 #include "Server.h"
 #include "StopTime.h"
+#include <algorithm>
+#include <cmath>
 
-TCPServer::TCPServer() : Running(false)
+#if PLATFORM_LINUX
+#include "BSDSockets/SocketsBSD.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+TCPServer::TCPServer() : Running(false), LastFrameNumber(0), FrameSent(false), LastFrameTaken(0), FrameTaken(false), PacketBodyPending(false), BatchSize(0),
+  BatchDelay(0), BatchPackets(0), BatchStart(0), BatchFirstPacket(0), BatchTakeSum(0), SendingBatch(false), PacketHeaderPending(false), Corked(false), SendData(nullptr),
+  SendSize(0), SendOffset(0), SendingPacket(false), SendStart(0), LastProgress(0), FramesSent(0), FramesDropped(0), LagSum(0), LagMax(0),
+  LastReport(0), FramesTaken(0), TakeDelaySum(0), TakeDelayMax(0)
 {
+  ThreadSettings.Cores = 0;
+  ThreadSettings.Priority = 0;
 }
 
 TCPServer::~TCPServer()
@@ -59,16 +72,14 @@ void TCPServer::Stop()
     Running = false;
     Buffer->Release();
     Thread.join();
-    Buffer->DoneReading();
   }
 
   // Disconnect and close client socket
   if(ClientSocket)
   {
-    ClientSocket->Close();
-    ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(ClientSocket);
-    ClientSocket = nullptr;
+    CloseClient();
   }
+  Packet.reset();
 
   // Disconnect and close listening socket
   if(ListenSocket)
@@ -83,6 +94,8 @@ void TCPServer::Stop()
 
 void TCPServer::ServerLoop()
 {
+  ThreadTuning::Apply(TEXT("UVServer"), ThreadSettings);
+
   while(Running)
   {
     // Check for connection of wait for connection
@@ -96,36 +109,338 @@ void TCPServer::ServerLoop()
     if(ClientSocket->GetConnectionState() != ESocketConnectionState::SCS_Connected)
     {
       OUT_WARN(TEXT("Client disconnected"));
-      ClientSocket->Close();
-      ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(ClientSocket);
-      ClientSocket = nullptr;
+      CloseClient();
       continue;
     }
 
-    // Everything is fine, wait for buffer to be readable
-    Buffer->StartReading();
-    if(!Running)
+    // Apply the settings requested by the client for the next packets
+    ReceiveRequests();
+
+    // Messages are never interrupted, the next one is only chosen when the current one is sent completely and
+    // the kernel does not need the packet for zero copy anymore
+    if(SendOffset == SendSize && Uring.IsIdle() && !NextMessage())
     {
-      Buffer->DoneReading();
-      break;
+      Buffer->WaitForData(BatchWaitMs());
+      continue;
     }
 
-    MEASURE_TIME("Transmitting data");
-    int32 BytesSent = 0;
-    OUT_INFO(TEXT("sending images."));
+    if(!(Uring.IsOpen() ? SendPendingUring() : SendPending()))
+    {
+      OUT_WARN(TEXT("Could not send data. Client disconnected."));
+      CloseClient();
+      continue;
+    }
 
-    // Send data to client
-    FDateTime Now = FDateTime::UtcNow();
-    Buffer->HeaderRead->TimestampSent = Now.ToUnixTimestamp() * 1000000000 + Now.GetMillisecond() * 1000000;
-    if(!ClientSocket->Send(Buffer->Read, Buffer->HeaderRead->Size, BytesSent) || BytesSent != Buffer->HeaderRead->Size)
+    const double Now = FPlatformTime::Seconds();
+    if(SendOffset < SendSize)
+    {
+      // The socket buffer is full, the client is dropped if it does not receive anything for too long
+      if(Now - LastProgress > SendTimeout)
+      {
+        OUT_WARN(TEXT("Client did not receive data for %.1f seconds. Disconnecting."), Now - LastProgress);
+        CloseClient();
+        continue;
+      }
+      // io_uring already waited for the completion
+      if(!Uring.IsOpen())
+      {
+        ClientSocket->Wait(ESocketWaitConditions::WaitForWrite, FTimespan::FromMilliseconds(WaitTimeoutMs));
+      }
+    }
+    else if(SendingPacket)
+    {
+      const double Lag = Now - SendStart;
+      ++FramesSent;
+      LagSum += Lag;
+      LagMax = std::max(LagMax, Lag);
+      SendingPacket = false;
+      // The body is complete, the last partial segment can leave
+      SetCork(false);
+    }
+    else if(SendingBatch)
+    {
+      // The batch was copied by the kernel, it can be reused
+      if(BatchPackets > 0)
+      {
+        FramesSent += BatchPackets;
+        LagSum += BatchPackets * Now - BatchTakeSum;
+        LagMax = std::max(LagMax, Now - BatchFirstPacket);
+      }
+      Batch.clear();
+      BatchPackets = 0;
+      BatchTakeSum = 0;
+      SendingBatch = false;
+    }
+    ReportStatistics(Now);
+  }
+}
+
+bool TCPServer::NextMessage()
+{
+  SendData = nullptr;
+  SendSize = SendOffset = 0;
+  SendingPacket = false;
+  FDateTime Now = FDateTime::UtcNow();
+  const uint64_t TimestampSent = Now.ToUnixTimestamp() * 1000000000 + Now.GetMillisecond() * 1000000;
+
+  // The rest of the packet directly follows its header
+  if(PacketBodyPending)
+  {
+    PacketBodyPending = false;
+    SendData = Packet->Data + sizeof(PacketBuffer::PacketHeader);
+    SendSize = SentHeader.Size - sizeof(PacketBuffer::PacketHeader);
+    SendingPacket = true;
+    return true;
+  }
+
+  // A packet that did not fit into the batch follows it
+  if(PacketHeaderPending)
+  {
+    PacketHeaderPending = false;
+    SentHeader.TimestampSent = TimestampSent;
+    return SendHeader();
+  }
+
+  // Pose records are small and sent first
+  Buffer->TakePoses(Poses);
+  if(!Poses.empty())
+  {
+    if(BatchSize == 0)
+    {
+      SendData = reinterpret_cast<const uint8 *>(Poses.data());
+      SendSize = Poses.size() * sizeof(PacketBuffer::PoseRecord);
+      return true;
+    }
+    AddToBatch(reinterpret_cast<const uint8 *>(Poses.data()), Poses.size() * sizeof(PacketBuffer::PoseRecord));
+    Poses.clear();
+  }
+
+  // Past frames are sent on their own after the batch
+  if(!HistoryFrames.empty() && !Batch.empty())
+  {
+    return SendBatch();
+  }
+
+  // Frames overwritten since the request are skipped, the client notices the gap in the frame numbers
+  while(!HistoryFrames.empty())
+  {
+    const uint32 FrameNumber = HistoryFrames.front();
+    HistoryFrames.erase(HistoryFrames.begin());
+    if(!History->Get(FrameNumber, HistoryPacket))
+    {
+      continue;
+    }
+    reinterpret_cast<PacketBuffer::PacketHeader *>(HistoryPacket.data())->TimestampSent = TimestampSent;
+    SendData = HistoryPacket.data();
+    SendSize = HistoryPacket.size();
+
+    // The next delta frame does not follow the last frame sent anymore
+    FrameSent = false;
+    return true;
+  }
+
+  // Only the newest packet is taken, older ones completed while sending were replaced by it
+  double ReadyTime = 0;
+  if(Buffer->TakePacket(Packet, ReadyTime) && AcceptPacket(ReadyTime))
+  {
+    SentHeader = *reinterpret_cast<const PacketBuffer::PacketHeader *>(Packet->Data);
+    SentHeader.TimestampSent = TimestampSent;
+    SendStart = FPlatformTime::Seconds();
+    if(BatchSize > 0 && SentHeader.Size <= BatchSize)
+    {
+      // Small packets are copied, so the slab can be reused right away
+      if(BatchPackets++ == 0)
+      {
+        BatchFirstPacket = SendStart;
+      }
+      BatchTakeSum += SendStart;
+      AddToBatch(reinterpret_cast<const uint8 *>(&SentHeader), sizeof(PacketBuffer::PacketHeader));
+      AddToBatch(Packet->Data + sizeof(PacketBuffer::PacketHeader), SentHeader.Size - sizeof(PacketBuffer::PacketHeader));
+      Packet.reset();
+    }
+    else if(!Batch.empty())
+    {
+      PacketHeaderPending = true;
+      return SendBatch();
+    }
+    else
+    {
+      return SendHeader();
+    }
+  }
+
+  // The batch is sent once it is full, its oldest data waited long enough or batching was disabled
+  if(!Batch.empty() && (BatchSize == 0 || Batch.size() >= BatchSize || FPlatformTime::Seconds() - BatchStart >= BatchDelay))
+  {
+    return SendBatch();
+  }
+  return false;
+}
+
+bool TCPServer::AcceptPacket(const double ReadyTime)
+{
+  const double TakeDelay = std::max(FPlatformTime::Seconds() - ReadyTime, 0.0);
+  ++FramesTaken;
+  TakeDelaySum += TakeDelay;
+  TakeDelayMax = std::max(TakeDelayMax, TakeDelay);
+
+  const PacketBuffer::PacketHeader *Header = reinterpret_cast<const PacketBuffer::PacketHeader *>(Packet->Data);
+  if(FrameTaken && Header->FrameNumber > LastFrameTaken + 1)
+  {
+    FramesDropped += Header->FrameNumber - LastFrameTaken - 1;
+  }
+  LastFrameTaken = Header->FrameNumber;
+  FrameTaken = true;
+
+  // Delta frames refer to the previous frame, if that was skipped the client has to wait for the next keyframe
+  if(Header->FrameType == PacketBuffer::FrameDelta && (!FrameSent || Header->FrameNumber != LastFrameNumber + 1))
+  {
+    OUT_INFO(TEXT("Skipping delta frame %d, requesting keyframe."), Header->FrameNumber);
+    Buffer->RequestKeyframe();
+    FrameSent = false;
+    ++FramesDropped;
+    return false;
+  }
+  LastFrameNumber = Header->FrameNumber;
+  FrameSent = true;
+  return true;
+}
+
+bool TCPServer::SendHeader()
+{
+  // Header and body leave in full segments
+  SetCork(true);
+  SendData = reinterpret_cast<const uint8 *>(&SentHeader);
+  SendSize = sizeof(PacketBuffer::PacketHeader);
+  PacketBodyPending = true;
+  LastProgress = FPlatformTime::Seconds();
+  return true;
+}
+
+bool TCPServer::SendBatch()
+{
+  SendData = Batch.data();
+  SendSize = Batch.size();
+  SendingBatch = true;
+  LastProgress = FPlatformTime::Seconds();
+  return true;
+}
+
+void TCPServer::AddToBatch(const uint8 *Data, const uint32 Size)
+{
+  if(Batch.empty())
+  {
+    BatchStart = FPlatformTime::Seconds();
+  }
+  Batch.insert(Batch.end(), Data, Data + Size);
+}
+
+uint32 TCPServer::BatchWaitMs() const
+{
+  if(Batch.empty())
+  {
+    return WaitTimeoutMs;
+  }
+  const double Remaining = BatchStart + BatchDelay - FPlatformTime::Seconds();
+  return (uint32)std::min(std::max(std::ceil(Remaining * 1000.0), 0.0), (double)WaitTimeoutMs);
+}
+
+void TCPServer::SetCork(const bool Cork)
+{
+#if PLATFORM_LINUX
+  // Without corking the header would leave in a segment of its own, as the socket does not wait with Nagle
+  if(Corked != Cork)
+  {
+    const int Value = Cork ? 1 : 0;
+    setsockopt(static_cast<FSocketBSD *>(ClientSocket)->GetNativeSocket(), IPPROTO_TCP, TCP_CORK, &Value, sizeof(Value));
+    Corked = Cork;
+  }
+#endif
+}
+
+bool TCPServer::SendPending()
+{
+  // Sends until the socket buffer is full
+  while(SendOffset < SendSize)
+  {
+    int32 BytesSent = 0;
+    if(!ClientSocket->Send(SendData + SendOffset, SendSize - SendOffset, BytesSent))
+    {
+      return ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->GetLastErrorCode() == SE_EWOULDBLOCK;
+    }
+    if(BytesSent <= 0)
     {
-      OUT_WARN(TEXT("Not all bytes sent. Client disconnected."));
-      ClientSocket->Close();
-      ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(ClientSocket);
-      ClientSocket = nullptr;
+      return true;
     }
-    // Release buffer
-    Buffer->DoneReading();
+    SendOffset += BytesSent;
+    LastProgress = FPlatformTime::Seconds();
+  }
+  return true;
+}
+
+bool TCPServer::SendPendingUring()
+{
+  // The whole remaining message is sent at once, the kernel waits for space in the socket buffer
+  if(Uring.IsIdle() && SendOffset < SendSize && !Uring.Send(SendData + SendOffset, SendSize - SendOffset, SendingPacket ? Packet.get() : nullptr))
+  {
+    return false;
+  }
+
+  uint32 BytesSent = 0;
+  if(!Uring.Complete(WaitTimeoutMs, BytesSent))
+  {
+    return false;
+  }
+  if(BytesSent > 0)
+  {
+    SendOffset += BytesSent;
+    LastProgress = FPlatformTime::Seconds();
+  }
+  return true;
+}
+
+void TCPServer::ReportStatistics(const double Now)
+{
+  if(Now - LastReport < ReportInterval)
+  {
+    return;
+  }
+  if(FramesSent > 0 || FramesDropped > 0)
+  {
+    const TCHAR *Backend = !Uring.IsOpen() ? TEXT("sockets") : Uring.IsZeroCopy() ? TEXT("io_uring zero copy") : TEXT("io_uring");
+    OUT_INFO(TEXT("Sent %d packets, dropped %d. Send lag: %.1f ms average, %.1f ms max (%s)."), FramesSent, FramesDropped,
+             FramesSent > 0 ? LagSum / FramesSent * 1000.0 : 0.0, LagMax * 1000.0, Backend);
+  }
+  if(FramesTaken > 0)
+  {
+    OUT_INFO(TEXT("Packets taken %.1f ms average, %.1f ms max after they were completed."), TakeDelaySum / FramesTaken * 1000.0,
+             TakeDelayMax * 1000.0);
+  }
+  FramesSent = FramesDropped = FramesTaken = 0;
+  LagSum = LagMax = TakeDelaySum = TakeDelayMax = 0;
+  LastReport = Now;
+}
+
+void TCPServer::CloseClient()
+{
+  Uring.Close();
+  ClientSocket->Close();
+  ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(ClientSocket);
+  ClientSocket = nullptr;
+  SendSize = SendOffset = 0;
+  SendingPacket = false;
+  PacketBodyPending = false;
+  PacketHeaderPending = false;
+  Corked = false;
+  Batch.clear();
+  BatchPackets = 0;
+  BatchTakeSum = 0;
+  SendingBatch = false;
+
+  // History, recording and multicast get all images again
+  if(Buffer.IsValid())
+  {
+    Buffer->SetStreams(PacketBuffer::StreamAll);
   }
 }
 
@@ -149,9 +464,7 @@ bool TCPServer::ListenConnections()
     // Destroy previous connection if available
     if(ClientSocket)
     {
-      ClientSocket->Close();
-      ISocketSubsystem::Get(PLATFORM_SOCKETSUBSYSTEM)->DestroySocket(ClientSocket);
-      ClientSocket = nullptr;
+      CloseClient();
     }
 
     // Set new connection
@@ -160,11 +473,41 @@ bool TCPServer::ListenConnections()
     if(ClientSocket)
     {
       OUT_INFO(TEXT("Client connected: %s"), *RemoteAddress->ToString(true));
+      RequestData.clear();
+      HistoryFrames.clear();
+      FrameSent = false;
+      FrameTaken = false;
+      LastProgress = LastReport = FPlatformTime::Seconds();
+      // io_uring needs a blocking socket to wait for space in the socket buffer itself
+      if(Uring.Open(ClientSocket))
+      {
+        OUT_INFO(TEXT("Sending with io_uring%s."), Uring.IsZeroCopy() ? TEXT(" and zero copy") : TEXT(""));
+        ClientSocket->SetNonBlocking(false);
+      }
+      else
+      {
+        ClientSocket->SetNonBlocking(true);
+      }
+      // Messages are always complete when they are sent, Nagle would only delay their last segment. Small packets
+      // are collected by batching instead if the client wants that.
+      ClientSocket->SetNoDelay(true);
+      BatchSize = 0;
+      BatchDelay = 0;
       if(Buffer.IsValid())
       {
+        // Clients not sending requests get the default settings
+        Buffer->SetDepthFormat(PacketBuffer::DepthFormatFloat16);
+        Buffer->SetNormalsFormat(PacketBuffer::NormalsFormatNone);
+        Buffer->SetRegion(PacketBuffer::ImageRegion());
+        Buffer->SetPoseStream(false);
+        Buffer->SetDeltaEncoding(0);
+        Buffer->SetStreams(PacketBuffer::StreamAll);
+
+        // The layout is changed by the writing thread, so the size is read once
+        const uint32 PacketSize = Buffer->GetSize();
         int32 NewSize = 0;
-        ClientSocket->SetSendBufferSize(Buffer->Size, NewSize);
-        if(NewSize < (int32)Buffer->Size)
+        ClientSocket->SetSendBufferSize(PacketSize, NewSize);
+        if(NewSize < (int32)PacketSize)
         {
           OUT_WARN(TEXT("Could not set socket buffer size. New size: %d"), NewSize);
         }
@@ -175,6 +518,145 @@ bool TCPServer::ListenConnections()
   return false;
 }
 
+void TCPServer::ReceiveRequests()
+{
+  const size_t MinSize = 2 * sizeof(uint32_t);
+  // Newer clients may send more fields, but a bogus size must not make the buffer grow without bound
+  const size_t MaxSize = 4 * sizeof(PacketBuffer::ClientRequest);
+  uint32 PendingSize = 0;
+
+  // Read everything that is available without blocking
+  while(ClientSocket->HasPendingData(PendingSize) && PendingSize > 0)
+  {
+    const size_t Offset = RequestData.size();
+    int32 BytesRead = 0;
+    RequestData.resize(Offset + PendingSize);
+    if(!ClientSocket->Recv(&RequestData[Offset], PendingSize, BytesRead))
+    {
+      BytesRead = 0;
+    }
+    RequestData.resize(Offset + BytesRead);
+    if(BytesRead <= 0)
+    {
+      break;
+    }
+  }
+
+  // Handle all complete requests
+  size_t Offset = 0;
+  while(RequestData.size() - Offset >= MinSize)
+  {
+    uint32_t Magic, RequestSize;
+    memcpy(&Magic, &RequestData[Offset], sizeof(uint32_t));
+    memcpy(&RequestSize, &RequestData[Offset + sizeof(uint32_t)], sizeof(uint32_t));
+    if(Magic != PacketBuffer::RequestMagic || RequestSize < MinSize || RequestSize > MaxSize)
+    {
+      OUT_WARN(TEXT("Received invalid request, discarding received data."));
+      RequestData.clear();
+      return;
+    }
+    if(RequestData.size() - Offset < RequestSize)
+    {
+      break;
+    }
+
+    // Fields not sent by the client keep their defaults
+    PacketBuffer::ClientRequest Request;
+    Request.FormatDepth = PacketBuffer::DepthFormatFloat16;
+    Request.DeltaInterval = 0;
+    Request.Keyframe = 0;
+    Request.FormatNormals = PacketBuffer::NormalsFormatNone;
+    Request.Region = PacketBuffer::ImageRegion();
+    Request.History = PacketBuffer::HistoryNone;
+    Request.HistoryFirst = Request.HistoryLast = 0;
+    Request.Poses = 0;
+    Request.Streams = PacketBuffer::StreamAll;
+    Request.BatchSize = 0;
+    Request.BatchDelay = 0;
+    memcpy(&Request, &RequestData[Offset], std::min<size_t>(RequestSize, sizeof(Request)));
+    HandleRequest(Request);
+    Offset += RequestSize;
+  }
+  RequestData.erase(RequestData.begin(), RequestData.begin() + Offset);
+}
+
+void TCPServer::HandleRequest(const PacketBuffer::ClientRequest &Request)
+{
+  if(Request.FormatDepth > PacketBuffer::DepthFormatUInt16)
+  {
+    OUT_WARN(TEXT("Unknown depth format requested: %d"), Request.FormatDepth);
+  }
+  else
+  {
+    OUT_INFO(TEXT("Client requested depth format %d."), Request.FormatDepth);
+    Buffer->SetDepthFormat((PacketBuffer::DepthFormat)Request.FormatDepth);
+  }
+
+  if(Request.FormatNormals > PacketBuffer::NormalsFormatFloat16)
+  {
+    OUT_WARN(TEXT("Unknown normals format requested: %d"), Request.FormatNormals);
+  }
+  else
+  {
+    Buffer->SetNormalsFormat((PacketBuffer::NormalsFormat)Request.FormatNormals);
+  }
+
+  if(Request.Region.Level > PacketBuffer::MaxLevel)
+  {
+    OUT_WARN(TEXT("Requested pyramid level %d is too high, using %d."), Request.Region.Level, PacketBuffer::MaxLevel);
+  }
+  Buffer->SetRegion(Request.Region);
+
+  if(Request.History != PacketBuffer::HistoryNone)
+  {
+    if(!History.IsValid())
+    {
+      OUT_WARN(TEXT("Client requested past frames, but the history is disabled."));
+    }
+    else if(Request.History == PacketBuffer::HistoryByNumber)
+    {
+      History->FindByNumber((uint32)Request.HistoryFirst, (uint32)std::min<uint64_t>(Request.HistoryLast, 0xFFFFFFFF), HistoryFrames);
+    }
+    else
+    {
+      History->FindByTimestamp(Request.HistoryFirst, Request.HistoryLast, HistoryFrames);
+    }
+    OUT_INFO(TEXT("Client requested past frames, %d available."), (int32)HistoryFrames.size());
+  }
+
+  Buffer->SetPoseStream(Request.Poses != 0);
+
+  // Images nobody wants are neither captured nor read back
+  if(Request.Streams & ~PacketBuffer::StreamAll)
+  {
+    OUT_WARN(TEXT("Unknown streams requested: %d"), Request.Streams);
+  }
+  Buffer->SetStreams(Request.Streams);
+
+  if(Request.DeltaInterval > 0)
+  {
+    OUT_INFO(TEXT("Client requested delta encoding with a keyframe every %d frames."), Request.DeltaInterval);
+  }
+  Buffer->SetDeltaEncoding(Request.DeltaInterval);
+  if(Request.Keyframe)
+  {
+    Buffer->RequestKeyframe();
+  }
+
+  // Larger batches need fewer sends, but packets wait longer
+  if(Request.BatchSize > MaxBatchSize)
+  {
+    OUT_WARN(TEXT("Requested batch size %d is too large, using %d."), Request.BatchSize, MaxBatchSize);
+  }
+  BatchSize = Request.BatchSize > MaxBatchSize ? MaxBatchSize : Request.BatchSize;
+  BatchDelay = Request.BatchDelay / 1000000.0;
+  if(BatchSize > 0)
+  {
+    OUT_INFO(TEXT("Client requested batches of %d Bytes sent after at most %d us."), BatchSize, Request.BatchDelay);
+    Batch.reserve(2 * BatchSize);
+  }
+}
+
 bool TCPServer::HasClient() const
 {
   return ClientSocket != nullptr;
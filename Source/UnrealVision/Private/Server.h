@@ -5,23 +5,109 @@
 #include "Sockets.h"
 #include "Networking.h"
 #include "PacketBuffer.h"
+#include "FrameHistory.h"
+#include "UringSender.h"
+#include "ThreadTuning.h"
 #include <thread>
+#include <vector>
 
 class UNREALVISION_API TCPServer
 {
 private:
+  // Time to wait for new data or free space in the socket buffer before checking for requests again
+  static const uint32 WaitTimeoutMs = 10;
+  // A client that does not receive any data for this time is disconnected
+  static constexpr double SendTimeout = 10.0;
+  // Interval for reporting the send statistics
+  static constexpr double ReportInterval = 10.0;
+  // Largest batch a client can request
+  static const uint32 MaxBatchSize = 4 * 1024 * 1024;
+
   FSocket *ListenSocket;
   FSocket *ClientSocket;
 
   std::thread Thread;
   volatile bool Running;
 
+  // Received data that does not form a complete request yet
+  std::vector<uint8> RequestData;
+
+  // Number of the last packet sent to the client, delta frames are only sent if they follow it directly
+  uint32_t LastFrameNumber;
+  bool FrameSent;
+  // Number of the last packet taken from the buffer, used for counting dropped packets
+  uint32_t LastFrameTaken;
+  bool FrameTaken;
+
+  // Past frames requested by the client and the buffer for sending them
+  std::vector<uint32> HistoryFrames;
+  std::vector<uint8> HistoryPacket;
+
+  // Pose records taken from the buffer, they are sent together
+  std::vector<PacketBuffer::PoseRecord> Poses;
+
+  // Packet taken from the buffer, it is shared with the other senders and must not be changed. The header is
+  // sent from a copy with the send timestamp, followed by the rest of the packet as a separate message.
+  SlabPool::SharedSlab Packet;
+  PacketBuffer::PacketHeader SentHeader;
+  bool PacketBodyPending;
+
+  // Sends with io_uring on Linux, the client socket is used directly if it is not available
+  UringSender Uring;
+
+  // Packets up to BatchSize bytes and pose records are collected and sent with one send if the client enabled
+  // batching. The batch is sent once it reaches BatchSize bytes or its oldest data waited BatchDelay seconds.
+  std::vector<uint8> Batch;
+  uint32 BatchSize;
+  double BatchDelay;
+  // Number of packets in the batch, the time the first data was added and the times the packets were taken
+  uint32 BatchPackets;
+  double BatchStart, BatchFirstPacket, BatchTakeSum;
+  bool SendingBatch;
+  // Packet too large for the batch taken while the batch was not sent yet, its header follows the batch
+  bool PacketHeaderPending;
+  // Partial segments are held back from the header until the body of a packet is sent
+  bool Corked;
+
+  // Message that is currently sent, it is either the packet, the pose records or a past frame
+  const uint8 *SendData;
+  uint32 SendSize, SendOffset;
+  bool SendingPacket;
+  // Time the packet was taken and the time of the last progress in seconds
+  double SendStart, LastProgress;
+
+  // Send statistics since the last report
+  uint32 FramesSent, FramesDropped;
+  double LagSum, LagMax, LastReport;
+  // Time from completing a packet until it was taken, it includes finishing the message sent before
+  uint32 FramesTaken;
+  double TakeDelaySum, TakeDelayMax;
+
   void ServerLoop();
   bool ListenConnections();
+  void CloseClient();
+  void ReceiveRequests();
+  void HandleRequest(const PacketBuffer::ClientRequest &Request);
+  bool NextMessage();
+  bool AcceptPacket(const double ReadyTime);
+  bool SendHeader();
+  bool SendBatch();
+  void AddToBatch(const uint8 *Data, const uint32 Size);
+  uint32 BatchWaitMs() const;
+  void SetCork(const bool Cork);
+  bool SendPending();
+  bool SendPendingUring();
+  void ReportStatistics(const double Now);
 
 public:
   // This pointer has to be set before starting the server
   TSharedPtr<PacketBuffer> Buffer;
+  // Optional history of past packets, has to be set before starting the server
+  TSharedPtr<FrameHistory> History;
+  // Cores and priority of the server thread, has to be set before starting the server
+  ThreadTuning::Settings ThreadSettings;
+  // Measures how fast the server wakes up for packets, notified by the packet buffer when a packet is completed
+  ThreadTiming Timing;
 
   TCPServer();
   ~TCPServer();
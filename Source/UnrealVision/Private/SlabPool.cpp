@@ -0,0 +1,133 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "SlabPool.h"
+
+#if PLATFORM_LINUX
+#include <sys/mman.h>
+#endif
+
+SlabPool::SlabPool()
+{
+}
+
+SlabPool::~SlabPool()
+{
+  for(size_t Index = 0; Index < FreeSlabs.size(); ++Index)
+  {
+    const size_t Capacity = (size_t)1 << (Index + MinClassBits);
+    for(uint8 *Data : FreeSlabs[Index])
+    {
+      FreeToOS(Data, Capacity);
+    }
+  }
+}
+
+SlabPool &SlabPool::Get()
+{
+  static SlabPool Pool;
+  return Pool;
+}
+
+SlabPool::Slab SlabPool::Acquire(const size_t Size)
+{
+  // Find the size class
+  size_t Index = 0;
+  while(((size_t)1 << (Index + MinClassBits)) < Size)
+  {
+    ++Index;
+  }
+  const size_t Capacity = (size_t)1 << (Index + MinClassBits);
+
+  Slab NewSlab;
+  NewSlab.Capacity = Capacity;
+  NewSlab.Data = nullptr;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if(Index < FreeSlabs.size() && !FreeSlabs[Index].empty())
+    {
+      NewSlab.Data = FreeSlabs[Index].back();
+      FreeSlabs[Index].pop_back();
+    }
+  }
+
+  if(!NewSlab.Data)
+  {
+    NewSlab.Data = AllocateFromOS(Capacity);
+    check(NewSlab.Data);
+  }
+  return NewSlab;
+}
+
+void SlabPool::Release(Slab &Buffer)
+{
+  if(!Buffer.Data)
+  {
+    return;
+  }
+
+  size_t Index = 0;
+  while(((size_t)1 << (Index + MinClassBits)) < Buffer.Capacity)
+  {
+    ++Index;
+  }
+
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if(FreeSlabs.size() <= Index)
+    {
+      FreeSlabs.resize(Index + 1);
+    }
+    FreeSlabs[Index].push_back(Buffer.Data);
+  }
+  Buffer.Data = nullptr;
+  Buffer.Capacity = 0;
+}
+
+SlabPool::SharedSlab SlabPool::Share(Slab &Buffer)
+{
+  Slab *Shared = new Slab(Buffer);
+  Buffer.Data = nullptr;
+  Buffer.Capacity = 0;
+  return SharedSlab(Shared, [this](Slab *Done)
+  {
+    Release(*Done);
+    delete Done;
+  });
+}
+
+uint8 *SlabPool::AllocateFromOS(const size_t Size)
+{
+#if PLATFORM_LINUX
+  if(Size >= HugePageSize)
+  {
+    // Try explicit huge pages first, they are only available if reserved by the system
+    void *Data = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(Data == MAP_FAILED)
+    {
+      // Fall back to transparent huge pages
+      Data = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(Data == MAP_FAILED)
+      {
+        return nullptr;
+      }
+      madvise(Data, Size, MADV_HUGEPAGE);
+    }
+    return reinterpret_cast<uint8 *>(Data);
+  }
+#endif
+  // Allocations from the OS are page aligned
+  return reinterpret_cast<uint8 *>(FPlatformMemory::BinnedAllocFromOS(Size));
+}
+
+void SlabPool::FreeToOS(uint8 *Data, const size_t Size)
+{
+#if PLATFORM_LINUX
+  if(Size >= HugePageSize)
+  {
+    munmap(Data, Size);
+    return;
+  }
+#endif
+  FPlatformMemory::BinnedFreeToOS(Data, Size);
+}
@@ -0,0 +1,54 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <vector>
+
+/**
+ * Pool of large page aligned memory blocks (slabs) for packet data. Slabs are grouped into power of two size
+ * classes and returned slabs are kept for reuse, so changing the packet size does not allocate memory again once
+ * a slab of that size class was used. Slabs of 2 MiB and larger are backed by huge pages where the OS supports it.
+ * Completed packets are shared by all senders, they are returned to the pool when the last sender is done.
+ */
+class UNREALVISION_API SlabPool
+{
+public:
+  struct Slab
+  {
+    uint8 *Data;
+    size_t Capacity;
+  };
+
+  // Shared slabs must not be changed anymore
+  typedef std::shared_ptr<const Slab> SharedSlab;
+
+private:
+  // Smallest size class is 64 KiB
+  static const uint32 MinClassBits = 16;
+  static const size_t HugePageSize = 2 * 1024 * 1024;
+
+  std::mutex Lock;
+  // Free slabs for each size class
+  std::vector<std::vector<uint8 *>> FreeSlabs;
+
+  static uint8 *AllocateFromOS(const size_t Size);
+  static void FreeToOS(uint8 *Data, const size_t Size);
+
+public:
+  SlabPool();
+  ~SlabPool();
+
+  // Pool shared by all packet buffers
+  static SlabPool &Get();
+
+  // Returns a slab with at least Size bytes
+  Slab Acquire(const size_t Size);
+
+  // Returns the slab to the pool, it will be reused by the next request of the same size class
+  void Release(Slab &Buffer);
+
+  // Moves the slab into a shared reference that returns it to the pool, Buffer is empty afterwards
+  SharedSlab Share(Slab &Buffer);
+};
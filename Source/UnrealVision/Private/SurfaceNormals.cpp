@@ -0,0 +1,147 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "SurfaceNormals.h"
+#include "ImageConversion.h"
+#include "Async/ParallelFor.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+static const uint32 RowsPerTile = 32;
+
+SurfaceNormals::SurfaceNormals() : Width(0), Height(0), CaptureWidth(0), CaptureHeight(0), FieldOfViewX(0), FieldOfViewY(0)
+{
+  Region.X = Region.Y = Region.Width = Region.Height = Region.Level = 0;
+}
+
+void SurfaceNormals::UpdateRays(const PacketBuffer::PacketHeader &Header)
+{
+  if(Header.Width == Width && Header.Height == Height && Header.CaptureWidth == CaptureWidth && Header.CaptureHeight == CaptureHeight &&
+     Header.FieldOfViewX == FieldOfViewX && Header.FieldOfViewY == FieldOfViewY && memcmp(&Header.Region, &Region, sizeof(Region)) == 0)
+  {
+    return;
+  }
+  Width = Header.Width;
+  Height = Header.Height;
+  CaptureWidth = Header.CaptureWidth;
+  CaptureHeight = Header.CaptureHeight;
+  FieldOfViewX = Header.FieldOfViewX;
+  FieldOfViewY = Header.FieldOfViewY;
+  Region = Header.Region;
+
+  // Pinhole model with the principal point in the center of the captured image, each pixel covers a block of the region.
+  // Pixels are square, so the vertical tangent follows from the horizontal one and the aspect ratio.
+  const float TanX = std::tan(FMath::DegreesToRadians(FieldOfViewX) * 0.5f);
+  const float TanY = TanX * CaptureHeight / CaptureWidth;
+  const float Block = (float)(1 << Region.Level);
+  RayX.SetNumUninitialized(Width);
+  RayY.SetNumUninitialized(Height);
+  for(uint32 X = 0; X < Width; ++X)
+  {
+    RayX[X] = ((Region.X + (X + 0.5f) * Block) / CaptureWidth * 2.0f - 1.0f) * TanX;
+  }
+  for(uint32 Y = 0; Y < Height; ++Y)
+  {
+    RayY[Y] = ((Region.Y + (Y + 0.5f) * Block) / CaptureHeight * 2.0f - 1.0f) * TanY;
+  }
+}
+
+void SurfaceNormals::Compute(const FFloat16 *Depth, const PacketBuffer::PacketHeader &Header, uint8 *Out)
+{
+  const PacketBuffer::NormalsFormat Format = (PacketBuffer::NormalsFormat)Header.FormatNormals;
+  UpdateRays(Header);
+  if(Width < 2 || Height < 2)
+  {
+    FMemory::Memzero(Out, Width * Height * (Format == PacketBuffer::NormalsFormatInt8 ? 3 : 3 * sizeof(FFloat16)));
+    return;
+  }
+
+  const float *Rx = RayX.GetData();
+  const float *Ry = RayY.GetData();
+  const int32 NumTiles = (Height + RowsPerTile - 1) / RowsPerTile;
+
+  ParallelFor(NumTiles, [&](int32 Tile)
+  {
+    const uint32 StartY = Tile * RowsPerTile;
+    const uint32 EndY = std::min<uint32>(Height, StartY + RowsPerTile);
+
+    // Depth of the rows of the tile plus one row above and below, invalid depth is set to NaN so that it
+    // propagates through the cross product
+    const uint32 FirstRow = StartY > 0 ? StartY - 1 : 0;
+    const uint32 LastRow = EndY < Height ? EndY : Height - 1;
+    TArray<float> Rows, NX, NY, NZ;
+    Rows.SetNumUninitialized((LastRow - FirstRow + 1) * Width);
+    NX.SetNumUninitialized(Width);
+    NY.SetNumUninitialized(Width);
+    NZ.SetNumUninitialized(Width);
+    ImageConversion::HalfToFloat(Depth + FirstRow * Width, Rows.GetData(), Rows.Num(), 1.0f);
+    const float Invalid = std::numeric_limits<float>::quiet_NaN();
+    for(float &Value : Rows)
+    {
+      Value = Value > 0.0f ? Value : Invalid;
+    }
+
+    for(uint32 Y = StartY; Y < EndY; ++Y)
+    {
+      const uint32 YUp = Y > 0 ? Y - 1 : Y;
+      const uint32 YDown = Y + 1 < Height ? Y + 1 : Y;
+      const float *Center = &Rows[(Y - FirstRow) * Width];
+      const float *Up = &Rows[(YUp - FirstRow) * Width];
+      const float *Down = &Rows[(YDown - FirstRow) * Width];
+      const float RayUp = Ry[YUp], RayCenter = Ry[Y], RayDown = Ry[YDown];
+
+      // Interior pixels use central differences, border pixels the difference to the pixel itself
+      auto Normal = [&](const uint32 X, const uint32 XLeft, const uint32 XRight)
+      {
+        const float DxX = Center[XRight] * Rx[XRight] - Center[XLeft] * Rx[XLeft];
+        const float DxY = (Center[XRight] - Center[XLeft]) * RayCenter;
+        const float DxZ = Center[XRight] - Center[XLeft];
+        const float DyX = (Down[X] - Up[X]) * Rx[X];
+        const float DyY = Down[X] * RayDown - Up[X] * RayUp;
+        const float DyZ = Down[X] - Up[X];
+        NX[X] = DyY * DxZ - DyZ * DxY;
+        NY[X] = DyZ * DxX - DyX * DxZ;
+        NZ[X] = DyX * DxY - DyY * DxX;
+      };
+      Normal(0, 0, 1);
+      for(uint32 X = 1; X + 1 < Width; ++X)
+      {
+        Normal(X, X - 1, X + 1);
+      }
+      Normal(Width - 1, Width - 2, Width - 1);
+
+      // Normalizing, pixels without depth, NaN and degenerated normals become zero
+      for(uint32 X = 0; X < Width; ++X)
+      {
+        const float Length = NX[X] * NX[X] + NY[X] * NY[X] + NZ[X] * NZ[X];
+        const bool Valid = Center[X] > 0.0f && Length > 1e-20f && Length < std::numeric_limits<float>::infinity();
+        const float Scale = Valid ? 1.0f / std::sqrt(Length) : 0.0f;
+        NX[X] = Scale != 0.0f ? NX[X] * Scale : 0.0f;
+        NY[X] = Scale != 0.0f ? NY[X] * Scale : 0.0f;
+        NZ[X] = Scale != 0.0f ? NZ[X] * Scale : 0.0f;
+      }
+
+      if(Format == PacketBuffer::NormalsFormatInt8)
+      {
+        int8 *Row = reinterpret_cast<int8 *>(Out) + Y * Width * 3;
+        for(uint32 X = 0; X < Width; ++X)
+        {
+          Row[X * 3 + 0] = (int8)std::lround(NX[X] * 127.0f);
+          Row[X * 3 + 1] = (int8)std::lround(NY[X] * 127.0f);
+          Row[X * 3 + 2] = (int8)std::lround(NZ[X] * 127.0f);
+        }
+      }
+      else
+      {
+        FFloat16 *Row = reinterpret_cast<FFloat16 *>(Out) + Y * Width * 3;
+        for(uint32 X = 0; X < Width; ++X)
+        {
+          Row[X * 3 + 0] = FFloat16(NX[X]);
+          Row[X * 3 + 1] = FFloat16(NY[X]);
+          Row[X * 3 + 2] = FFloat16(NZ[X]);
+        }
+      }
+    }
+  });
+}
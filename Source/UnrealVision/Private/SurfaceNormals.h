@@ -0,0 +1,31 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "PacketBuffer.h"
+
+/**
+ * Computes surface normals from the depth image. Each pixel is projected into 3D with a ray table that is cached
+ * for the current resolution, region and field of view, the normal is the cross product of the differences between the
+ * vertical and the horizontal neighbors. Normals are given in the optical frame of the camera (x right, y down,
+ * z forward) and point towards the camera. Pixels with invalid depth in their neighborhood get a zero normal.
+ * The image is split into tiles of rows that are processed in parallel.
+ */
+class UNREALVISION_API SurfaceNormals
+{
+private:
+  uint32 Width, Height, CaptureWidth, CaptureHeight;
+  float FieldOfViewX, FieldOfViewY;
+  PacketBuffer::ImageRegion Region;
+  // The ray of pixel (X, Y) is (RayX[X], RayY[Y], 1)
+  TArray<float> RayX, RayY;
+
+  // Recomputes the ray table if the resolution, the region or the field of view changed
+  void UpdateRays(const PacketBuffer::PacketHeader &Header);
+
+public:
+  SurfaceNormals();
+
+  // Computes the normals for a Float16 depth image in meters with the size, region, field of view and normals format of the header
+  void Compute(const FFloat16 *Depth, const PacketBuffer::PacketHeader &Header, uint8 *Out);
+};
@@ -0,0 +1,221 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "ThreadTuning.h"
+#include <algorithm>
+#include <cmath>
+
+#if PLATFORM_LINUX
+#include <pthread.h>
+#include <sched.h>
+#elif PLATFORM_WINDOWS
+#include "AllowWindowsPlatformTypes.h"
+#include <windows.h>
+#include "HideWindowsPlatformTypes.h"
+#endif
+
+// Sets the affinity of the calling thread
+static void SetAffinity(const uint64 Mask)
+{
+#if PLATFORM_LINUX
+  // Set directly, so that cores beyond the ones known to the engine can be used as well
+  cpu_set_t Set;
+  CPU_ZERO(&Set);
+  for(uint32 Core = 0; Core < 64; ++Core)
+  {
+    if(Mask & (1ull << Core))
+    {
+      CPU_SET(Core, &Set);
+    }
+  }
+  const int Error = pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set);
+  if(Error != 0)
+  {
+    OUT_WARN(TEXT("Could not set thread affinity 0x%llx: %d"), Mask, Error);
+  }
+#else
+  FPlatformProcess::SetThreadAffinityMask(Mask);
+#endif
+}
+
+uint64 ThreadTuning::ParseCores(const FString &List)
+{
+  TArray<FString> Ranges;
+  List.ParseIntoArray(Ranges, TEXT(","), true);
+
+  uint64 Mask = 0;
+  for(FString &Range : Ranges)
+  {
+    Range.Trim();
+    Range.TrimTrailing();
+    FString First, Last;
+    if(!Range.Split(TEXT("-"), &First, &Last))
+    {
+      First = Last = Range;
+    }
+    if(!First.IsNumeric() || !Last.IsNumeric())
+    {
+      OUT_WARN(TEXT("Invalid core list: %s"), *List);
+      return 0;
+    }
+
+    const int32 Begin = FCString::Atoi(*First);
+    const int32 End = FCString::Atoi(*Last);
+    if(Begin < 0 || End < Begin || End >= 64)
+    {
+      OUT_WARN(TEXT("Invalid core range %s, cores have to be from 0 to 63."), *Range);
+      return 0;
+    }
+    for(int32 Core = Begin; Core <= End; ++Core)
+    {
+      Mask |= 1ull << Core;
+    }
+  }
+  return Mask;
+}
+
+bool ThreadTuning::Apply(const TCHAR *Name, const Settings &ThreadSettings)
+{
+  FPlatformProcess::SetThreadName(Name);
+  if(ThreadSettings.Cores != 0)
+  {
+    SetAffinity(ThreadSettings.Cores);
+  }
+  if(ThreadSettings.Priority <= 0)
+  {
+    return true;
+  }
+
+#if PLATFORM_LINUX
+  // Round robin lets threads of the same priority take turns, which matters if they share a core
+  sched_param Param;
+  memset(&Param, 0, sizeof(Param));
+  Param.sched_priority = std::min(ThreadSettings.Priority, sched_get_priority_max(SCHED_RR));
+  const int Error = pthread_setschedparam(pthread_self(), SCHED_RR, &Param);
+  if(Error != 0)
+  {
+    OUT_WARN(TEXT("Could not set real-time priority %d for %s: %d. It needs CAP_SYS_NICE or an rtprio limit."), Param.sched_priority, Name, Error);
+    return false;
+  }
+#elif PLATFORM_WINDOWS
+  // Windows only has a few levels, the upper half of the range is time critical
+  const int Level = ThreadSettings.Priority >= 50 ? THREAD_PRIORITY_TIME_CRITICAL : THREAD_PRIORITY_HIGHEST;
+  if(!::SetThreadPriority(::GetCurrentThread(), Level))
+  {
+    OUT_WARN(TEXT("Could not set priority for %s: %d"), Name, (int32)::GetLastError());
+    return false;
+  }
+#else
+  OUT_WARN(TEXT("Thread priorities are not supported on this platform."));
+  return false;
+#endif
+  return true;
+}
+
+void ThreadTuning::ReserveCores(const uint64 Reserved)
+{
+  uint64 GameMask = FPlatformAffinity::GetMainGameMask();
+  uint64 RenderMask = FPlatformAffinity::GetRenderingThreadMask();
+  if(Reserved != 0)
+  {
+    const int32 NumCores = std::min(FPlatformMisc::NumberOfCoresIncludingHyperthreads(), 64);
+    const uint64 AllCores = NumCores >= 64 ? ~0ull : (1ull << NumCores) - 1;
+    const uint64 Remaining = AllCores & ~Reserved;
+    if(Remaining == 0)
+    {
+      OUT_WARN(TEXT("No cores left for the game and render thread, not reserving any."));
+      return;
+    }
+    OUT_INFO(TEXT("Keeping the game and render thread on cores 0x%llx."), Remaining);
+    GameMask = RenderMask = Remaining;
+  }
+
+  SetAffinity(GameMask);
+  if(GIsThreadedRendering)
+  {
+    ENQUEUE_UNIQUE_RENDER_COMMAND_ONEPARAMETER(SetRenderThreadAffinity, uint64, RenderMask, RenderMask,
+    {
+      SetAffinity(RenderMask);
+    });
+  }
+}
+
+ThreadTiming::ThreadTiming() : Name(TEXT("")), Enabled(false), NotifyTime(0), LastWakeup(0), LastReport(0), Wakeups(0), Intervals(0),
+  LatencySum(0), LatencyMax(0), IntervalSum(0), IntervalSquares(0), IntervalMin(0), IntervalMax(0)
+{
+}
+
+void ThreadTiming::Setup(const TCHAR *_Name, const bool _Enabled)
+{
+  Name = _Name;
+  Enabled = _Enabled;
+  NotifyTime = 0;
+  LastWakeup = 0;
+  LastReport = FPlatformTime::Seconds();
+  Wakeups = Intervals = 0;
+  LatencySum = LatencyMax = IntervalSum = IntervalSquares = IntervalMin = IntervalMax = 0;
+}
+
+void ThreadTiming::Notify()
+{
+  if(Enabled)
+  {
+    NotifyTime = FPlatformTime::Seconds();
+  }
+}
+
+void ThreadTiming::Woken()
+{
+  if(!Enabled)
+  {
+    return;
+  }
+
+  const double Now = FPlatformTime::Seconds();
+  const double Notified = NotifyTime.exchange(0);
+  if(Notified > 0)
+  {
+    const double Latency = std::max(Now - Notified, 0.0);
+    LatencySum += Latency;
+    LatencyMax = std::max(LatencyMax, Latency);
+    ++Wakeups;
+  }
+  if(LastWakeup > 0)
+  {
+    const double Interval = Now - LastWakeup;
+    IntervalSum += Interval;
+    IntervalSquares += Interval * Interval;
+    IntervalMin = Intervals == 0 ? Interval : std::min(IntervalMin, Interval);
+    IntervalMax = std::max(IntervalMax, Interval);
+    ++Intervals;
+  }
+  LastWakeup = Now;
+  Report(Now);
+}
+
+void ThreadTiming::Skip()
+{
+  if(Enabled)
+  {
+    NotifyTime = 0;
+  }
+}
+
+void ThreadTiming::Report(const double Now)
+{
+  if(Now - LastReport < ReportInterval)
+  {
+    return;
+  }
+  if(Intervals > 0)
+  {
+    const double Mean = IntervalSum / Intervals;
+    const double Jitter = std::sqrt(std::max(IntervalSquares / Intervals - Mean * Mean, 0.0));
+    OUT_INFO(TEXT("Thread %s: wake-up latency %.3f ms average, %.3f ms max. Interval %.2f ms average (%.2f to %.2f ms), jitter %.3f ms."), Name,
+             Wakeups > 0 ? LatencySum / Wakeups * 1000.0 : 0.0, LatencyMax * 1000.0, Mean * 1000.0, IntervalMin * 1000.0, IntervalMax * 1000.0,
+             Jitter * 1000.0);
+  }
+  Wakeups = Intervals = 0;
+  LatencySum = LatencyMax = IntervalSum = IntervalSquares = IntervalMin = IntervalMax = 0;
+  LastReport = Now;
+}
@@ -0,0 +1,67 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include <atomic>
+
+/**
+ * Places the pipeline threads on chosen cores with a chosen priority, so that they do not compete with the game
+ * and render thread. The settings are applied by each thread to itself when it starts.
+ */
+class UNREALVISION_API ThreadTuning
+{
+public:
+  struct Settings
+  {
+    uint64 Cores; // Affinity mask, 0 for any core
+    int32 Priority; // 0 keeps the default priority, 1 to 99 for real-time scheduling
+  };
+
+  // Parses a list of cores like "2,4-7" into an affinity mask, returns 0 for an empty or invalid list
+  static uint64 ParseCores(const FString &List);
+
+  // Names the calling thread and applies the settings to it, returns false if the priority could not be set
+  static bool Apply(const TCHAR *Name, const Settings &ThreadSettings);
+
+  // Restricts the game thread and the render thread to the cores not in Reserved, 0 restores their defaults.
+  // Has to be called from the game thread.
+  static void ReserveCores(const uint64 Reserved);
+};
+
+/**
+ * Measures how regularly a thread runs. The wake-up latency is the time from Notify until the thread runs
+ * again, the jitter is the standard deviation of the interval between wake-ups. Both are logged every
+ * ReportInterval seconds by the measured thread.
+ */
+class UNREALVISION_API ThreadTiming
+{
+private:
+  static constexpr double ReportInterval = 10.0;
+
+  const TCHAR *Name;
+  bool Enabled;
+  // Time of the last notification in seconds, 0 if the thread was not notified since it last woke up
+  std::atomic<double> NotifyTime;
+  double LastWakeup, LastReport;
+
+  // Statistics since the last report
+  uint32 Wakeups, Intervals;
+  double LatencySum, LatencyMax, IntervalSum, IntervalSquares, IntervalMin, IntervalMax;
+
+  void Report(const double Now);
+
+public:
+  ThreadTiming();
+
+  // Enables or disables measuring, has to be called before the thread starts
+  void Setup(const TCHAR *_Name, const bool _Enabled);
+
+  // Called by the thread waking up the measured one right before notifying it
+  void Notify();
+
+  // Called by the measured thread after it woke up for a new frame
+  void Woken();
+
+  // Called by the measured thread instead of Woken if the frame was already there and it did not have to wait
+  void Skip();
+};
@@ -2,12 +2,14 @@
 
 #include "UnrealVision.h"
 #include "UnrealVisionPrivatePCH.h"
+#include "ImageConversion.h"
 
 #define LOCTEXT_NAMESPACE "FUnrealVisionModule"
 
 void FUnrealVisionModule::StartupModule()
 {
   // This code will execute after your module is loaded into memory; the exact timing is specified in the .uplugin file per-module
+  ImageConversion::Initialize();
 }
 
 void FUnrealVisionModule::ShutdownModule()
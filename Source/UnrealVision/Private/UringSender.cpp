@@ -0,0 +1,305 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#include "UnrealVision.h"
+#include "UringSender.h"
+#include <algorithm>
+
+#if PLATFORM_LINUX && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+// Fast poll is needed for waiting on blocking sockets, the extended arguments for waiting with a timeout
+#if defined(IORING_FEAT_FAST_POLL) && defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define UNREALVISION_URING 1
+#include "BSDSockets/SocketsBSD.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+#else
+#define UNREALVISION_URING 0
+#endif
+
+UringSender::UringSender() : Ring(-1), Socket(-1), ZeroCopy(false), SendPending(false), NotificationPending(false), SQRing(nullptr),
+  CQRing(nullptr), SQRingSize(0), CQRingSize(0), SQEntries(nullptr), SQEntriesSize(0)
+{
+}
+
+UringSender::~UringSender()
+{
+  Close();
+}
+
+#if UNREALVISION_URING
+
+// Identifies the completions of the send request, notifications have the same user data
+static const uint64 SendUserData = 1;
+
+bool UringSender::Open(FSocket *_Socket)
+{
+  Close();
+
+  // Two entries are enough for a send and its notification
+  io_uring_params Params;
+  memset(&Params, 0, sizeof(Params));
+  Ring = (int)syscall(__NR_io_uring_setup, 4, &Params);
+  if(Ring < 0)
+  {
+    return false;
+  }
+  if(!(Params.features & IORING_FEAT_FAST_POLL) || !(Params.features & IORING_FEAT_EXT_ARG))
+  {
+    Close();
+    return false;
+  }
+
+  SQRingSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32);
+  CQRingSize = Params.cq_off.cqes + Params.cq_entries * sizeof(io_uring_cqe);
+  if(Params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    SQRingSize = CQRingSize = std::max(SQRingSize, CQRingSize);
+  }
+  SQEntriesSize = Params.sq_entries * sizeof(io_uring_sqe);
+
+  void *Mapped = mmap(nullptr, SQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring, IORING_OFF_SQ_RING);
+  if(Mapped == MAP_FAILED)
+  {
+    Close();
+    return false;
+  }
+  SQRing = reinterpret_cast<uint8 *>(Mapped);
+  if(Params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    CQRing = SQRing;
+  }
+  else
+  {
+    Mapped = mmap(nullptr, CQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring, IORING_OFF_CQ_RING);
+    if(Mapped == MAP_FAILED)
+    {
+      Close();
+      return false;
+    }
+    CQRing = reinterpret_cast<uint8 *>(Mapped);
+  }
+  Mapped = mmap(nullptr, SQEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, Ring, IORING_OFF_SQES);
+  if(Mapped == MAP_FAILED)
+  {
+    Close();
+    return false;
+  }
+  SQEntries = Mapped;
+
+  SQHead = reinterpret_cast<uint32 *>(SQRing + Params.sq_off.head);
+  SQTail = reinterpret_cast<uint32 *>(SQRing + Params.sq_off.tail);
+  SQMask = reinterpret_cast<uint32 *>(SQRing + Params.sq_off.ring_mask);
+  SQArray = reinterpret_cast<uint32 *>(SQRing + Params.sq_off.array);
+  CQHead = reinterpret_cast<uint32 *>(CQRing + Params.cq_off.head);
+  CQTail = reinterpret_cast<uint32 *>(CQRing + Params.cq_off.tail);
+  CQMask = reinterpret_cast<uint32 *>(CQRing + Params.cq_off.ring_mask);
+  CQEntries = CQRing + Params.cq_off.cqes;
+
+  // Zero copy is only used if the kernel knows the operation
+  ZeroCopy = false;
+#ifdef IORING_CQE_F_NOTIF
+  const uint32 NumOps = IORING_OP_SEND_ZC + 1;
+  std::vector<uint8> Probe(sizeof(io_uring_probe) + NumOps * sizeof(io_uring_probe_op), 0);
+  io_uring_probe *Ops = reinterpret_cast<io_uring_probe *>(Probe.data());
+  if(syscall(__NR_io_uring_register, Ring, IORING_REGISTER_PROBE, Ops, NumOps) == 0 && Ops->last_op >= IORING_OP_SEND_ZC)
+  {
+    ZeroCopy = (Ops->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED) != 0;
+  }
+#endif
+
+  Socket = static_cast<FSocketBSD *>(_Socket)->GetNativeSocket();
+  SendPending = NotificationPending = false;
+  return true;
+}
+
+void UringSender::Close()
+{
+  // Closing the ring cancels pending requests, the kernel keeps pages of zero copy sends until they are done
+  if(SQEntries)
+  {
+    munmap(SQEntries, SQEntriesSize);
+  }
+  if(CQRing && CQRing != SQRing)
+  {
+    munmap(CQRing, CQRingSize);
+  }
+  if(SQRing)
+  {
+    munmap(SQRing, SQRingSize);
+  }
+  if(Ring >= 0)
+  {
+    close(Ring);
+  }
+  SQEntries = nullptr;
+  SQRing = CQRing = nullptr;
+  Ring = Socket = -1;
+  Registered.clear();
+  SendPending = NotificationPending = false;
+}
+
+int32 UringSender::FindRegistered(const SlabPool::Slab &Slab)
+{
+  for(size_t i = 0; i < Registered.size(); ++i)
+  {
+    if(Registered[i].Data == Slab.Data && Registered[i].Capacity == Slab.Capacity)
+    {
+      return (int32)i;
+    }
+  }
+
+  // Buffers can only be registered as a whole, so all of them are registered again without the oldest one
+  if(!Registered.empty())
+  {
+    syscall(__NR_io_uring_register, Ring, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+  }
+  if(Registered.size() >= MaxRegistered)
+  {
+    Registered.erase(Registered.begin());
+  }
+  Registered.push_back(Slab);
+
+  std::vector<iovec> Buffers(Registered.size());
+  for(size_t i = 0; i < Registered.size(); ++i)
+  {
+    Buffers[i].iov_base = Registered[i].Data;
+    Buffers[i].iov_len = Registered[i].Capacity;
+  }
+  if(syscall(__NR_io_uring_register, Ring, IORING_REGISTER_BUFFERS, Buffers.data(), (uint32)Buffers.size()) != 0)
+  {
+    // Pinning the memory can fail because of RLIMIT_MEMLOCK. It would fail again for every packet, so zero copy
+    // is disabled and the data is copied from now on.
+    OUT_WARN(TEXT("Could not register packet buffers for zero copy: %d. Sending with copies."), errno);
+    Registered.clear();
+    ZeroCopy = false;
+    return -1;
+  }
+  return (int32)Registered.size() - 1;
+}
+
+bool UringSender::Send(const uint8 *Data, const uint32 Size, const SlabPool::Slab *Slab)
+{
+  const int32 Index = ZeroCopy && Slab ? FindRegistered(*Slab) : -1;
+
+  const uint32 Tail = *SQTail;
+  const uint32 Entry = Tail & *SQMask;
+  io_uring_sqe *SQE = reinterpret_cast<io_uring_sqe *>(SQEntries) + Entry;
+  memset(SQE, 0, sizeof(io_uring_sqe));
+  SQE->opcode = IORING_OP_SEND;
+  SQE->fd = Socket;
+  SQE->addr = (uint64)Data;
+  SQE->len = Size;
+  SQE->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  SQE->user_data = SendUserData;
+#ifdef IORING_CQE_F_NOTIF
+  if(Index >= 0)
+  {
+    SQE->opcode = IORING_OP_SEND_ZC;
+    SQE->ioprio = IORING_RECVSEND_FIXED_BUF;
+    SQE->buf_index = (uint16)Index;
+  }
+#endif
+  SQArray[Entry] = Entry;
+  __atomic_store_n(SQTail, Tail + 1, __ATOMIC_RELEASE);
+
+  if(syscall(__NR_io_uring_enter, Ring, 1, 0, 0, nullptr, 0) != 1)
+  {
+    return false;
+  }
+  SendPending = true;
+  return true;
+}
+
+bool UringSender::Complete(const uint32 TimeoutMs, uint32 &BytesSent)
+{
+  if(IsIdle())
+  {
+    return true;
+  }
+
+  // Waits for at least one completion, it returns early with ETIME if the timeout is reached
+  __kernel_timespec Timeout;
+  Timeout.tv_sec = TimeoutMs / 1000;
+  Timeout.tv_nsec = (TimeoutMs % 1000) * 1000000;
+  io_uring_getevents_arg Arg;
+  memset(&Arg, 0, sizeof(Arg));
+  Arg.ts = (uint64)&Timeout;
+  if(__atomic_load_n(CQHead, __ATOMIC_RELAXED) == __atomic_load_n(CQTail, __ATOMIC_ACQUIRE))
+  {
+    syscall(__NR_io_uring_enter, Ring, 0, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &Arg, sizeof(Arg));
+  }
+
+  bool Success = true;
+  uint32 Head = __atomic_load_n(CQHead, __ATOMIC_RELAXED);
+  while(Head != __atomic_load_n(CQTail, __ATOMIC_ACQUIRE))
+  {
+    const io_uring_cqe *CQE = reinterpret_cast<const io_uring_cqe *>(CQEntries) + (Head & *CQMask);
+#ifdef IORING_CQE_F_NOTIF
+    if(CQE->flags & IORING_CQE_F_NOTIF)
+    {
+      NotificationPending = false;
+      ++Head;
+      continue;
+    }
+    // Zero copy sends are followed by a notification once the kernel does not need the data anymore
+    NotificationPending = (CQE->flags & IORING_CQE_F_MORE) != 0;
+#endif
+    SendPending = false;
+    if(CQE->res >= 0)
+    {
+      BytesSent += (uint32)CQE->res;
+    }
+    else if(CQE->res != -EAGAIN && CQE->res != -EINTR)
+    {
+      Success = false;
+    }
+    ++Head;
+  }
+  __atomic_store_n(CQHead, Head, __ATOMIC_RELEASE);
+  return Success;
+}
+
+#else
+
+bool UringSender::Open(FSocket *_Socket)
+{
+  return false;
+}
+
+void UringSender::Close()
+{
+}
+
+bool UringSender::Send(const uint8 *Data, const uint32 Size, const SlabPool::Slab *Slab)
+{
+  return false;
+}
+
+bool UringSender::Complete(const uint32 TimeoutMs, uint32 &BytesSent)
+{
+  return true;
+}
+
+#endif
+
+bool UringSender::IsOpen() const
+{
+  return Ring >= 0;
+}
+
+bool UringSender::IsZeroCopy() const
+{
+  return ZeroCopy;
+}
+
+bool UringSender::IsIdle() const
+{
+  return !SendPending && !NotificationPending;
+}
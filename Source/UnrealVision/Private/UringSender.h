@@ -0,0 +1,63 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "Sockets.h"
+#include "SlabPool.h"
+#include <vector>
+
+/**
+ * Sends data over a connected socket using io_uring on Linux 5.11 and newer. Data in registered slabs is sent
+ * with zero copy if the kernel supports it (6.0 and newer), everything else is copied by the kernel like with
+ * send. On other platforms or if io_uring is not available Open fails and the sockets are used directly.
+ *
+ * Only one send is in flight at a time. The socket has to be blocking, io_uring waits for space in the socket
+ * buffer internally. With zero copy the data must not be changed until IsIdle returns true again.
+ */
+class UNREALVISION_API UringSender
+{
+private:
+  // Number of slabs kept registered, the oldest one is replaced if another slab is sent
+  static const uint32 MaxRegistered = 8;
+
+  int Ring;
+  int Socket;
+  bool ZeroCopy;
+  bool SendPending, NotificationPending;
+
+  // Mapped rings of the submission and completion queue
+  uint8 *SQRing, *CQRing;
+  size_t SQRingSize, CQRingSize;
+  void *SQEntries;
+  size_t SQEntriesSize;
+  uint32 *SQHead, *SQTail, *SQMask, *SQArray;
+  uint32 *CQHead, *CQTail, *CQMask;
+  void *CQEntries;
+
+  // Slabs registered as fixed buffers
+  std::vector<SlabPool::Slab> Registered;
+
+  int32 FindRegistered(const SlabPool::Slab &Slab);
+
+public:
+  UringSender();
+  ~UringSender();
+
+  // Returns true if io_uring is available for the socket
+  bool Open(FSocket *_Socket);
+  void Close();
+
+  bool IsOpen() const;
+  bool IsZeroCopy() const;
+
+  // Returns true if no send or zero copy notification is pending
+  bool IsIdle() const;
+
+  // Starts sending Size bytes. Slab is the slab containing the data or nullptr, only data in slabs is sent with
+  // zero copy.
+  bool Send(const uint8 *Data, const uint32 Size, const SlabPool::Slab *Slab);
+
+  // Waits up to TimeoutMs for completions and adds the number of bytes sent to BytesSent. Returns false if the
+  // send failed.
+  bool Complete(const uint32 TimeoutMs, uint32 &BytesSent);
+};
@@ -5,11 +5,22 @@
 #include "StopTime.h"
 #include "Server.h"
 #include "PacketBuffer.h"
+#include "ImageConversion.h"
+#include "ObjectStatistics.h"
+#include "DeltaEncoder.h"
+#include "SurfaceNormals.h"
+#include "ImageResampling.h"
+#include "FrameHistory.h"
+#include "PacketRecorder.h"
+#include "MulticastSender.h"
+#include "FrameSource.h"
+#include "ThreadTuning.h"
 #include <fstream>
 #include <sstream>
 #include <algorithm>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <cmath>
 #include <condition_variable>
 
@@ -18,24 +29,222 @@
 class UNREALVISION_API AVisionActor::PrivateData
 {
 public:
+  // Identifies a vertex color buffer that can be shared by all components with the same mesh and color. The mesh
+  // is compared by identity, so a new mesh at the address of a destroyed one does not get its buffer.
+  struct VertexColorKey
+  {
+    TWeakObjectPtr<UStaticMesh> Mesh;
+    uint32 ColorIndex;
+
+    VertexColorKey() : ColorIndex(0)
+    {
+    }
+
+    VertexColorKey(UStaticMesh *_Mesh, const uint32 _ColorIndex) : Mesh(_Mesh), ColorIndex(_ColorIndex)
+    {
+    }
+
+    bool operator==(const VertexColorKey &Other) const
+    {
+      return Mesh.HasSameIndexAndSerialNumber(Other.Mesh) && ColorIndex == Other.ColorIndex;
+    }
+
+    friend uint32 GetTypeHash(const VertexColorKey &Key)
+    {
+      return HashCombine(GetTypeHash(Key.Mesh), GetTypeHash(Key.ColorIndex));
+    }
+  };
+
+  struct SharedVertexColors
+  {
+    FColorVertexBuffer *Buffer;
+    uint32 References;
+  };
+
   TSharedPtr<PacketBuffer> Buffer;
+  TSharedPtr<FrameHistory> History;
   TCPServer Server;
   std::mutex WaitColor, WaitDepth, WaitObject, WaitDone;
   std::condition_variable CVColor, CVDepth, CVObject, CVDone;
   std::thread ThreadColor, ThreadDepth, ThreadObject;
+  // Cores and priority of the processing threads, how regularly they run and the cores kept free of the engine
+  ThreadTuning::Settings ProcessingSettings;
+  ThreadTiming TimingColor, TimingDepth, TimingObject;
+  uint64 ReservedCores;
   bool DoColor, DoDepth, DoObject;
   bool DoneColor, DoneObject;
+  // Set from handing a frame to the processing threads until it is done, the next frame is handed over afterwards
+  std::atomic<bool> FramePending;
+  // Number of the current tick, shared by pose records and packets
+  uint64 Sequence;
+  // Pose of the current tick
+  PacketBuffer::PoseRecord Pose;
+  // Used to wait until the previous frame is done
+  std::mutex WaitCredit;
+  std::condition_variable CVCredit;
+
+  // Camera poses for the batch mode and the number of poses already set
+  TArray<FTransform> Trajectory;
+  int32 BatchStep;
+
+  // Writes all packets to a file if a recording file is set
+  PacketRecorder Recorder;
+  // Sends all packets to a multicast group if one is set
+  TSharedPtr<MulticastSender> Multicast;
+
+  // A frame requested from the source, the images it contains and the pose of the tick it was captured in
+  struct RequestedFrame
+  {
+    PacketBuffer::PoseRecord Pose;
+    uint32 Streams;
+  };
+
+  // Reads the images without blocking the game thread and the frames requested from it
+  TSharedPtr<FrameSource> Source;
+  TArray<RequestedFrame> RequestedFrames;
+
+  // Time since the last capture of color, depth and object images, the images captured in the previous tick and
+  // the pose they were rendered with
+  float TimePassed[3];
+  uint32 CapturedStreams;
+  PacketBuffer::PoseRecord CapturedPose;
+
+  // Copy of the id lookup table for the current frame, only accessed while holding WaitObject
+  TArray<uint32> FrameIdToLabel;
+  // Colors of all objects for the current frame, only accessed while holding WaitObject
+  TSet<uint32> FrameColors;
+  // Statistics of the visible objects
+  TArray<PacketBuffer::ObjectStatsEntry> ObjectStats;
+
+  // Previous images for delta frames and the number of bytes written to each image of the current packet
+  DeltaEncoder DeltaColor, DeltaDepth, DeltaObject, DeltaNormals;
+  uint32 SizeDataColor, SizeDataDepth, SizeDataObject, SizeDataNormals;
+
+  // Computes the normals from the depth image, only used if a client requested them
+  SurfaceNormals Normals;
+
+  // Cropped and downscaled images if the client requested a region or pyramid level
+  TArray<FColor> ReducedColor, ReducedObject;
+  TArray<FFloat16> ReducedDepth;
+
+  // Returns true if the images of the packet do not cover the complete captured images
+  static bool IsReduced(const PacketBuffer::PacketHeader *Header)
+  {
+    return Header->Width != Header->CaptureWidth || Header->Height != Header->CaptureHeight;
+  }
+
+  // Returns true if the image of the stream is encoded complete, in keyframes or if it was missing in the keyframe
+  static bool IsKeyframe(const PacketBuffer::PacketHeader *Header, const uint32 Stream)
+  {
+    return Header->FrameType == PacketBuffer::FrameKeyframe || (Header->StreamsComplete & Stream) != 0;
+  }
+
+  // Components are compared by identity, weak pointers to destroyed objects would all be equal otherwise
+  struct ComponentKeyFuncs : TDefaultMapKeyFuncs<TWeakObjectPtr<UStaticMeshComponent>, VertexColorKey, false>
+  {
+    static FORCEINLINE bool Matches(KeyInitType A, KeyInitType B)
+    {
+      return A.HasSameIndexAndSerialNumber(B);
+    }
+  };
+
+  // Vertex color buffers shared between components and the components using them
+  TMap<VertexColorKey, SharedVertexColors> VertexColors;
+  TMap<TWeakObjectPtr<UStaticMeshComponent>, VertexColorKey, FDefaultSetAllocator, ComponentKeyFuncs> ColoredComponents;
+
+  // Returns the buffer for the given mesh and color, it is only created if no other component uses it yet
+  FColorVertexBuffer *AcquireVertexColors(const VertexColorKey &Key, const FColor &ObjectColor, const uint32 NumVertices)
+  {
+    SharedVertexColors *Shared = VertexColors.Find(Key);
+    if(Shared)
+    {
+      ++Shared->References;
+      return Shared->Buffer;
+    }
+
+    FColorVertexBuffer *NewBuffer = new FColorVertexBuffer;
+    NewBuffer->InitFromSingleColor(ObjectColor, NumVertices);
+    BeginInitResource(NewBuffer);
+    VertexColors.Add(Key, SharedVertexColors{NewBuffer, 1});
+    return NewBuffer;
+  }
+
+  // Releases one reference, the buffer is freed on the render thread after the last component let go of it
+  void ReleaseVertexColors(const VertexColorKey &Key)
+  {
+    SharedVertexColors *Shared = VertexColors.Find(Key);
+    if(!Shared || --Shared->References > 0)
+    {
+      return;
+    }
+
+    FColorVertexBuffer *OldBuffer = Shared->Buffer;
+    VertexColors.Remove(Key);
+    BeginReleaseResource(OldBuffer);
+    ENQUEUE_UNIQUE_RENDER_COMMAND_ONEPARAMETER(DeleteVertexColors, FColorVertexBuffer *, OldBuffer, OldBuffer,
+    {
+      delete OldBuffer;
+    });
+  }
+
+  // Removes the shared buffer from a component, the component would delete it otherwise
+  void DetachVertexColors(UStaticMeshComponent *Component)
+  {
+    const VertexColorKey *Key = ColoredComponents.Find(Component);
+    if(!Key)
+    {
+      return;
+    }
+
+    if(Component->LODData.Num() > 0)
+    {
+      Component->LODData[0].OverrideVertexColors = nullptr;
+      Component->MarkRenderStateDirty();
+    }
+    ReleaseVertexColors(*Key);
+    ColoredComponents.Remove(Component);
+  }
+
+  /* Components destroyed without their owner ending play, by DestroyComponent or a rerun construction script,
+   * would delete the shared buffer with their LOD data. They are only pending kill until the next garbage
+   * collection, so this is called right before it. Components that are already gone took the buffer with them,
+   * it is forgotten without releasing it again.
+   */
+  void DetachDestroyedComponents()
+  {
+    TArray<UStaticMeshComponent *> Destroyed;
+    for(auto It = ColoredComponents.CreateIterator(); It; ++It)
+    {
+      UStaticMeshComponent *Component = It.Key().Get(true);
+      if(!Component)
+      {
+        OUT_WARN(TEXT("A colored component was destroyed with a shared vertex color buffer."));
+        VertexColors.Remove(It.Value());
+        It.RemoveCurrent();
+      }
+      else if(Component->IsPendingKill())
+      {
+        Destroyed.Add(Component);
+      }
+    }
+    for(UStaticMeshComponent *Component : Destroyed)
+    {
+      DetachVertexColors(Component);
+    }
+  }
 };
 
 // Sets default values
-AVisionActor::AVisionActor() : ACameraActor(), Width(960), Height(540), Framerate(1), FieldOfView(90.0), ServerPort(10000), FrameTime(1.0f / Framerate), TimePassed(0), ColorsUsed(0)
+AVisionActor::AVisionActor() : ACameraActor(), Width(960), Height(540), Framerate(1), ColorFramerate(0), DepthFramerate(0), ObjectFramerate(0), FieldOfView(90.0), ServerPort(10000), EncodeObjectIds(false), HistoryFrames(0), HistoryMemory(256), BatchMode(false), MulticastPort(10001),
+  MulticastBlockSize(16), ThreadPriority(0), ReserveCores(false), MeasureThreadTiming(false), ColorsUsed(0), ResolutionChanged(false)
 {
   Priv = new PrivateData();
 
   // Set this actor to call Tick() every frame.  You can turn this off to improve performance if you don't need it.
   PrimaryActorTick.bCanEverTick = true;
 
-  // Initializing buffers for reading images from the GPU
+  // Initializing buffers for reading images from the GPU. Color and object images are read as 8 bit BGRA,
+  // depth as single channel Float16. Linear gamma is forced so that the values are stored unaltered.
   ImageColor.AddUninitialized(Width * Height);
   ImageDepth.AddUninitialized(Width * Height);
   ImageObject.AddUninitialized(Width * Height);
@@ -45,8 +254,10 @@ AVisionActor::AVisionActor() : ACameraActor(), Width(960), Height(540), Framerat
   Color->SetupAttachment(RootComponent);
   Color->CaptureSource = ESceneCaptureSource::SCS_FinalColorLDR;
   Color->TextureTarget = CreateDefaultSubobject<UTextureRenderTarget2D>(TEXT("ColorTarget"));
-  Color->TextureTarget->InitAutoFormat(Width, Height);
+  Color->TextureTarget->InitCustomFormat(Width, Height, PF_B8G8R8A8, true);
   Color->FOVAngle = FieldOfView;
+  Color->bCaptureEveryFrame = false;
+  Color->bCaptureOnMovement = false;
   //Color->TextureTarget->TargetGamma = GEngine->GetDisplayGamma();
 
   OUT_INFO(TEXT("Creating depth camera."));
@@ -54,16 +265,20 @@ AVisionActor::AVisionActor() : ACameraActor(), Width(960), Height(540), Framerat
   Depth->SetupAttachment(RootComponent);
   Depth->CaptureSource = ESceneCaptureSource::SCS_FinalColorLDR;
   Depth->TextureTarget = CreateDefaultSubobject<UTextureRenderTarget2D>(TEXT("DepthTarget"));
-  Depth->TextureTarget->InitAutoFormat(Width, Height);
+  Depth->TextureTarget->InitCustomFormat(Width, Height, PF_R16F, true);
   Depth->FOVAngle = FieldOfView;
+  Depth->bCaptureEveryFrame = false;
+  Depth->bCaptureOnMovement = false;
 
   OUT_INFO(TEXT("Creating object camera."));
   Object = CreateDefaultSubobject<USceneCaptureComponent2D>(TEXT("ObjectCapture"));
   Object->SetupAttachment(RootComponent);
   Object->CaptureSource = ESceneCaptureSource::SCS_FinalColorLDR;
   Object->TextureTarget = CreateDefaultSubobject<UTextureRenderTarget2D>(TEXT("ObjectTarget"));
-  Object->TextureTarget->InitAutoFormat(Width, Height);
+  Object->TextureTarget->InitCustomFormat(Width, Height, PF_B8G8R8A8, true);
   Object->FOVAngle = FieldOfView;
+  Object->bCaptureEveryFrame = false;
+  Object->bCaptureOnMovement = false;
 
   GetCameraComponent()->FieldOfView = FieldOfView;
   GetCameraComponent()->AspectRatio = Width / (float)Height;
@@ -85,10 +300,6 @@ AVisionActor::AVisionActor() : ACameraActor(), Width(960), Height(540), Framerat
   }
   else
     OUT_ERROR(TEXT("Could not load material for depth."));
-
-  // Creating double buffer and setting the pointer of the server object
-  Priv->Buffer = TSharedPtr<PacketBuffer>(new PacketBuffer(Width, Height, FieldOfView));
-  Priv->Server.Buffer = Priv->Buffer;
 }
 
 AVisionActor::~AVisionActor()
@@ -103,11 +314,92 @@ void AVisionActor::BeginPlay()
   Super::BeginPlay();
   OUT_INFO(TEXT("Begin play!"));
 
+  // Creating double buffer and setting the pointer of the server object
+  const PacketBuffer::ObjectFormat FormatObject = EncodeObjectIds ? PacketBuffer::ObjectFormatLabel : PacketBuffer::ObjectFormatColor;
+  Priv->Buffer = TSharedPtr<PacketBuffer>(new PacketBuffer(Width, Height, FieldOfView, FormatObject));
+  Priv->Server.Buffer = Priv->Buffer;
+  Priv->Buffer->ReaderTiming = &Priv->Server.Timing;
+
+  // The history keeps the last packets for clients connecting later
+  if(HistoryFrames > 0)
+  {
+    Priv->History = TSharedPtr<FrameHistory>(new FrameHistory(HistoryFrames, (size_t)std::max(HistoryMemory, 1) * 1024 * 1024));
+    Priv->Server.History = Priv->History;
+  }
+
+  // Render targets were created with the default resolution
+  ApplyResolution();
+
+  // Without rendering test patterns are processed instead
+  if(GUsingNullRHI)
+  {
+    OUT_INFO(TEXT("Rendering is disabled, using synthetic images."));
+    Priv->Source = TSharedPtr<FrameSource>(new SyntheticSource());
+  }
+  else
+  {
+    Priv->Source = TSharedPtr<FrameSource>(new RenderTargetSource(Color->TextureTarget, Depth->TextureTarget, Object->TextureTarget));
+  }
+  Priv->RequestedFrames.Reset();
+  Priv->CapturedStreams = 0;
+  std::fill(Priv->TimePassed, Priv->TimePassed + 3, 0.0f);
+
+  if(!RecordingFile.IsEmpty())
+  {
+    Priv->Recorder.Open(RecordingFile);
+  }
+
+  // Pipeline threads apply their settings when they start, the engine threads can be kept off their cores
+  Priv->ProcessingSettings.Cores = ThreadTuning::ParseCores(ProcessingCores);
+  Priv->ProcessingSettings.Priority = ThreadPriority;
+  Priv->Server.ThreadSettings.Cores = ThreadTuning::ParseCores(ServerCores);
+  Priv->Server.ThreadSettings.Priority = ThreadPriority;
+  Priv->ReservedCores = ReserveCores ? Priv->ProcessingSettings.Cores | Priv->Server.ThreadSettings.Cores : 0;
+  if(Priv->ReservedCores)
+  {
+    ThreadTuning::ReserveCores(Priv->ReservedCores);
+  }
+  Priv->TimingColor.Setup(TEXT("UVColor"), MeasureThreadTiming);
+  Priv->TimingDepth.Setup(TEXT("UVDepth"), MeasureThreadTiming);
+  Priv->TimingObject.Setup(TEXT("UVObject"), MeasureThreadTiming);
+  Priv->Server.Timing.Setup(TEXT("UVServer"), MeasureThreadTiming);
+
+  if(!MulticastGroup.IsEmpty())
+  {
+    Priv->Multicast = TSharedPtr<MulticastSender>(new MulticastSender(std::max(MulticastBlockSize, 0)));
+    Priv->Multicast->ThreadSettings = Priv->Server.ThreadSettings;
+    Priv->Multicast->Timing.Setup(TEXT("UVMulticast"), MeasureThreadTiming);
+    if(!Priv->Multicast->Start(MulticastGroup, MulticastPort))
+    {
+      Priv->Multicast.Reset();
+    }
+  }
+
+  // In batch mode the engine advances in fixed steps as fast as possible instead of following the wall clock
+  Priv->BatchStep = 0;
+  Priv->Trajectory.Reset();
+  if(BatchMode)
+  {
+    if(LoadTrajectory(TrajectoryFile))
+    {
+      OUT_INFO(TEXT("Batch mode with %d poses and a step of %f s."), Priv->Trajectory.Num(), 1.0f / Framerate);
+      FApp::SetUseFixedTimeStep(true);
+      FApp::SetFixedDeltaTime(1.0 / Framerate);
+    }
+    else
+    {
+      OUT_ERROR(TEXT("Could not load trajectory from %s, batch mode disabled."), *TrajectoryFile);
+      BatchMode = false;
+    }
+  }
+
   // Starting server
   Priv->Server.Start(ServerPort);
 
-  // Coloring all objects
+  // Coloring all objects and keep track of objects spawned later on
   ColorAllObjects();
+  ActorSpawnedHandle = GetWorld()->AddOnActorSpawnedHandler(FOnActorSpawned::FDelegate::CreateUObject(this, &AVisionActor::OnActorSpawned));
+  PreGarbageCollectHandle = FCoreUObjectDelegates::PreGarbageCollect.AddUObject(this, &AVisionActor::OnPreGarbageCollect);
 
   Running = true;
   Paused = false;
@@ -118,6 +410,8 @@ void AVisionActor::BeginPlay()
 
   Priv->DoneColor = false;
   Priv->DoneObject = false;
+  Priv->FramePending = false;
+  Priv->Sequence = 0;
 
   // Starting threads to process image data
   Priv->ThreadColor = std::thread(&AVisionActor::ProcessColor, this);
@@ -131,6 +425,8 @@ void AVisionActor::EndPlay(const EEndPlayReason::Type EndPlayReason)
   Super::EndPlay(EndPlayReason);
   OUT_INFO(TEXT("End play!"));
 
+  // No images are written after this, frames that were already read are still processed
+  Priv->Source->Reset();
   Running = false;
 
   // Stopping processing threads
@@ -146,6 +442,40 @@ void AVisionActor::EndPlay(const EEndPlayReason::Type EndPlayReason)
   Priv->ThreadObject.join();
 
   Priv->Server.Stop();
+  Priv->Recorder.Close();
+  if(Priv->Multicast.IsValid())
+  {
+    Priv->Multicast->Stop();
+    Priv->Multicast.Reset();
+  }
+  if(BatchMode)
+  {
+    FApp::SetUseFixedTimeStep(false);
+  }
+  if(Priv->ReservedCores)
+  {
+    ThreadTuning::ReserveCores(0);
+  }
+
+  // Components must not keep the shared vertex colors, they would delete them on destruction
+  GetWorld()->RemoveOnActorSpawnedHandler(ActorSpawnedHandle);
+  FCoreUObjectDelegates::PreGarbageCollect.Remove(PreGarbageCollectHandle);
+  Priv->DetachDestroyedComponents();
+  TArray<TWeakObjectPtr<UStaticMeshComponent>> Components;
+  Priv->ColoredComponents.GetKeys(Components);
+  for(const TWeakObjectPtr<UStaticMeshComponent> &Weak : Components)
+  {
+    UStaticMeshComponent *Component = Weak.Get();
+    if(!Component)
+    {
+      continue;
+    }
+    if(AActor *Owner = Component->GetOwner())
+    {
+      Owner->OnEndPlay.RemoveDynamic(this, &AVisionActor::OnActorEndPlay);
+    }
+    Priv->DetachVertexColors(Component);
+  }
 }
 
 // Called every frame
@@ -159,75 +489,356 @@ void AVisionActor::Tick(float DeltaTime)
     return;
   }
 
-  // Check for framerate
-  TimePassed += DeltaTime;
-  if(TimePassed < 1.0f / Framerate)
+  // Pose of the camera for this tick in meters and ROS coordinate system, sent at the tick rate
+  FDateTime Now = FDateTime::UtcNow();
+  FVector Translation = GetActorLocation();
+  FQuat Rotation = GetActorQuat();
+  PacketBuffer::PoseRecord &Pose = Priv->Pose;
+  Pose.Size = sizeof(PacketBuffer::PoseRecord);
+  Pose.Magic = PacketBuffer::PoseMagic;
+  Pose.Sequence = ++Priv->Sequence;
+  // Batch recordings use the simulation time, so that they are reproducible
+  Pose.Timestamp = BatchMode ? (uint64)(GetWorld()->GetTimeSeconds() * 1000000000.0) : Now.ToUnixTimestamp() * 1000000000 + Now.GetMillisecond() * 1000000;
+  Pose.Translation.X = Translation.X / 100.0f;
+  Pose.Translation.Y = -Translation.Y / 100.0f;
+  Pose.Translation.Z = Translation.Z / 100.0f;
+  Pose.Rotation.X = -Rotation.X;
+  Pose.Rotation.Y = Rotation.Y;
+  Pose.Rotation.Z = -Rotation.Z;
+  Pose.Rotation.W = Rotation.W;
+  Priv->Buffer->AddPose(Pose);
+
+  if(BatchMode)
+  {
+    TickBatch();
+    return;
+  }
+
+  // Frames read back from the GPU are processed independent of the framerate
+  HandOverFrame(false);
+
+  // Images captured at the end of the previous tick are read back now
+  RequestFrame();
+
+  // Check for the framerate of each stream
+  const uint32 Due = DueStreams(DeltaTime);
+  if(!Due)
   {
     return;
   }
-  TimePassed -= 1.0f / Framerate;
   //MEASURE_TIME("Tick");
   //OUT_INFO(TEXT("FRAME_RATE: %f"),Framerate)
 
   UpdateComponentTransforms();
 
-  // Check if client is connected
-  if(!Priv->Server.HasClient())
+  // Resize between frames, the render targets need one frame to be rendered with the new size. Frames that are
+  // not processed yet are dropped.
+  if(ResolutionChanged)
   {
+    if(Priv->FramePending)
+    {
+      return;
+    }
+    Priv->Source->Reset();
+    Priv->RequestedFrames.Reset();
+    ApplyResolution();
     return;
   }
 
-  FDateTime Now = FDateTime::UtcNow();
-  Priv->Buffer->HeaderWrite->TimestampCapture = Now.ToUnixTimestamp() * 1000000000 + Now.GetMillisecond() * 1000000;
+  // Check if client is connected, with history, recording or multicast frames are also captured without clients
+  if(!Priv->Server.HasClient() && !Priv->History.IsValid() && !Priv->Recorder.IsOpen() && !Priv->Multicast.IsValid())
+  {
+    return;
+  }
+  CaptureStreams(Due);
+}
 
-  FVector Translation = GetActorLocation();
-  FQuat Rotation = GetActorQuat();
-  // Convert to meters and ROS coordinate system
-  Priv->Buffer->HeaderWrite->Translation.X = Translation.X / 100.0f;
-  Priv->Buffer->HeaderWrite->Translation.Y = -Translation.Y / 100.0f;
-  Priv->Buffer->HeaderWrite->Translation.Z = Translation.Z / 100.0f;
-  Priv->Buffer->HeaderWrite->Rotation.X = -Rotation.X;
-  Priv->Buffer->HeaderWrite->Rotation.Y = Rotation.Y;
-  Priv->Buffer->HeaderWrite->Rotation.Z = -Rotation.Z;
-  Priv->Buffer->HeaderWrite->Rotation.W = Rotation.W;
+uint32 AVisionActor::DueStreams(const float DeltaTime)
+{
+  // Streams without a framerate of their own use the common one
+  const float Rates[3] = {ColorFramerate, DepthFramerate, ObjectFramerate};
+  const uint32 Flags[3] = {PacketBuffer::StreamColor, PacketBuffer::StreamDepth, PacketBuffer::StreamObject};
+  uint32 Due = 0;
+  for(uint32 i = 0; i < 3; ++i)
+  {
+    const float Period = 1.0f / (Rates[i] > 0 ? Rates[i] : Framerate);
+    Priv->TimePassed[i] += DeltaTime;
+    if(Priv->TimePassed[i] >= Period)
+    {
+      Priv->TimePassed[i] -= Period;
+      Due |= Flags[i];
+    }
+  }
+  return Due;
+}
+
+void AVisionActor::CaptureStreams(const uint32 Streams)
+{
+  // Only images a client wants are rendered, the captures are done at the end of the tick. History, recording and
+  // multicast always need all images, the TCP client then gets them as well.
+  uint32 Requested = Priv->Buffer->GetStreams();
+  if(Priv->History.IsValid() || Priv->Recorder.IsOpen() || Priv->Multicast.IsValid())
+  {
+    Requested = PacketBuffer::StreamAll;
+  }
+  const uint32 Wanted = Streams & Requested;
+  if(Wanted & PacketBuffer::StreamColor)
+  {
+    Color->UpdateContent();
+  }
+  if(Wanted & PacketBuffer::StreamDepth)
+  {
+    Depth->UpdateContent();
+  }
+  if(Wanted & PacketBuffer::StreamObject)
+  {
+    Object->UpdateContent();
+  }
+  Priv->CapturedStreams = Wanted;
+  Priv->CapturedPose = Priv->Pose;
+}
+
+void AVisionActor::TickBatch()
+{
+  HandOverFrame(false);
+
+  // The images read in this tick were rendered with the pose set in the previous tick after its pose record was
+  // taken, so they get the pose record of this tick. Every step is captured, so the simulation waits until the
+  // pipeline can take the next frame.
+  if(Priv->CapturedStreams)
+  {
+    while(!Priv->Source->Request(Priv->CapturedStreams))
+    {
+      HandOverFrame(true);
+    }
+    Priv->RequestedFrames.Add(PrivateData::RequestedFrame{Priv->Pose, Priv->CapturedStreams});
+    Priv->CapturedStreams = 0;
+  }
+
+  // The resolution is changed between steps. The frames of the previous steps are processed with the old size
+  // first, so none is lost, and like in real time the next step is captured one tick after the resize.
+  if(ResolutionChanged)
+  {
+    while(HandOverFrame(true))
+    {
+    }
+    {
+      std::unique_lock<std::mutex> Lock(Priv->WaitCredit);
+      Priv->CVCredit.wait(Lock, [this] {return !Priv->FramePending; });
+    }
+    Priv->Source->Reset();
+    Priv->RequestedFrames.Reset();
+    ApplyResolution();
+    return;
+  }
+
+  // All streams are captured in every step, the framerates only apply in real time
+  if(Priv->BatchStep < Priv->Trajectory.Num())
+  {
+    const FTransform &Transform = Priv->Trajectory[Priv->BatchStep++];
+    SetActorLocationAndRotation(Transform.GetLocation(), Transform.GetRotation());
+    UpdateComponentTransforms();
+    CaptureStreams(PacketBuffer::StreamAll);
+  }
+  else
+  {
+    // Ticks stop with the pause, so the remaining frames are handed over now
+    while(HandOverFrame(true))
+    {
+    }
+    OUT_INFO(TEXT("Batch capture done, %d frames captured."), Priv->BatchStep);
+    Pause();
+  }
+}
+
+bool AVisionActor::LoadTrajectory(const FString &Path)
+{
+  std::ifstream File(TCHAR_TO_UTF8(*Path));
+  if(!File.is_open())
+  {
+    return false;
+  }
+
+  std::string Line;
+  while(std::getline(File, Line))
+  {
+    if(Line.empty() || Line[0] == '#')
+    {
+      continue;
+    }
+    std::istringstream Stream(Line);
+    float X, Y, Z, QX, QY, QZ, QW;
+    if(!(Stream >> X >> Y >> Z >> QX >> QY >> QZ >> QW))
+    {
+      OUT_WARN(TEXT("Invalid trajectory line: %s"), UTF8_TO_TCHAR(Line.c_str()));
+      continue;
+    }
+
+    // Convert from meters and ROS coordinate system, the inverse of the conversion of the packet pose
+    const FQuat Rotation(-QX, QY, -QZ, QW);
+    Priv->Trajectory.Add(FTransform(Rotation.GetNormalized(), FVector(X * 100.0f, -Y * 100.0f, Z * 100.0f)));
+  }
+  return Priv->Trajectory.Num() > 0;
+}
+
+void AVisionActor::RequestFrame()
+{
+  const uint32 Streams = Priv->CapturedStreams;
+  if(!Streams)
+  {
+    return;
+  }
+  Priv->CapturedStreams = 0;
+
+  // If the processing can not keep up, all slots are in use and the frame is skipped. The pose of this tick is
+  // already the next one, the frame gets the pose it was captured with.
+  if(Priv->Source->Request(Streams))
+  {
+    Priv->RequestedFrames.Add(PrivateData::RequestedFrame{Priv->CapturedPose, Streams});
+  }
+}
+
+bool AVisionActor::HandOverFrame(const bool Wait)
+{
+  if(Wait)
+  {
+    std::unique_lock<std::mutex> Lock(Priv->WaitCredit);
+    Priv->CVCredit.wait(Lock, [this] {return !Priv->FramePending; });
+  }
+  else if(Priv->FramePending)
+  {
+    return false;
+  }
+
+  if(!Priv->Source->Poll(Wait))
+  {
+    return false;
+  }
+  const PrivateData::RequestedFrame Frame = Priv->RequestedFrames[0];
+  const PacketBuffer::PoseRecord &Pose = Frame.Pose;
+  Priv->RequestedFrames.RemoveAt(0, 1, false);
+  Priv->FramePending = true;
 
   // Start writing to buffer
-  Priv->Buffer->StartWriting(ObjectToColor, ObjectColors);
+  Priv->Buffer->SetCapturedStreams(Frame.Streams);
+  if(EncodeObjectIds)
+  {
+    Priv->Buffer->StartWriting(ObjectNames);
+  }
+  else
+  {
+    Priv->Buffer->StartWriting(ObjectToColor, ObjectColors);
+  }
 
-  // Read color image and notify processing thread
-  Priv->WaitColor.lock();
-  ReadImage(Color->TextureTarget, ImageColor);
-  Priv->WaitColor.unlock();
-  Priv->DoColor = true;
-  Priv->CVColor.notify_one();
+  // The images get the pose of the tick they were requested in, so that they can be joined with the pose records
+  Priv->Buffer->HeaderWrite->TimestampCapture = Pose.Timestamp;
+  Priv->Buffer->HeaderWrite->Sequence = Pose.Sequence;
+  Priv->Buffer->HeaderWrite->Translation = Pose.Translation;
+  Priv->Buffer->HeaderWrite->Rotation = Pose.Rotation;
 
-  // Read object image and notify processing thread
   Priv->WaitObject.lock();
-  ReadImage(Object->TextureTarget, ImageObject);
+  if(EncodeObjectIds)
+  {
+    Priv->FrameIdToLabel = IdToLabel;
+  }
+  else
+  {
+    Priv->FrameColors.Reset();
+    for(const auto &Elem : ObjectToColor)
+    {
+      const FColor &ObjectColor = ObjectColors[Elem.Value];
+      Priv->FrameColors.Add(((uint32)ObjectColor.R << 16) | ((uint32)ObjectColor.G << 8) | (uint32)ObjectColor.B);
+    }
+  }
   Priv->WaitObject.unlock();
-  Priv->DoObject = true;
-  Priv->CVObject.notify_one();
 
-  /* Read depth image and notify processing thread. Depth processing is called last,
-   * because the color image processing thread take more time so they can already begin.
-   * The depth processing thread will wait for the others to be finished and then releases
-   * the buffer.
+  /* The processing threads are idle while no frame is pending, so the images can be written without locking.
+   * Width and Height might already be changed for the next frame, the header has the size of the images.
+   * Depth processing is notified last, because the color image processing thread take more time so they can
+   * already begin. The depth processing thread will wait for the others to be finished and then releases the
+   * buffer. Threads of images missing in the frame are not woken up, they count as done.
    */
-  Priv->WaitDepth.lock();
-  ReadImage(Depth->TextureTarget, ImageDepth);
-  Priv->WaitDepth.unlock();
-  Priv->DoDepth = true;
-  Priv->CVDepth.notify_one();
+  const PacketBuffer::PacketHeader *Header = Priv->Buffer->HeaderWrite;
+  const FrameSource::Images Out{Header->CaptureWidth, Header->CaptureHeight, ImageColor.GetData(), ImageDepth.GetData(), ImageObject.GetData()};
+  const uint32 Streams = Frame.Streams;
+  Priv->SizeDataColor = 0;
+  Priv->SizeDataObject = 0;
+  // Each thread is notified for the timing inside the lock, so it can not see the flag before the time is set
+  Priv->Source->Read(Out, [this, Streams]()
+  {
+    if(Streams & PacketBuffer::StreamColor)
+    {
+      {
+        std::lock_guard<std::mutex> Lock(Priv->WaitColor);
+        Priv->TimingColor.Notify();
+        Priv->DoColor = true;
+      }
+      Priv->CVColor.notify_one();
+    }
+    if(Streams & PacketBuffer::StreamObject)
+    {
+      {
+        std::lock_guard<std::mutex> Lock(Priv->WaitObject);
+        Priv->TimingObject.Notify();
+        Priv->DoObject = true;
+      }
+      Priv->CVObject.notify_one();
+    }
+    {
+      std::lock_guard<std::mutex> Lock(Priv->WaitDone);
+      if(!(Streams & PacketBuffer::StreamColor))
+      {
+        Priv->DoneColor = true;
+      }
+      if(!(Streams & PacketBuffer::StreamObject))
+      {
+        Priv->DoneObject = true;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> Lock(Priv->WaitDepth);
+      Priv->TimingDepth.Notify();
+      Priv->DoDepth = true;
+    }
+    Priv->CVDepth.notify_one();
+  });
+  return true;
 }
 
 void AVisionActor::SetFramerate(const float _Framerate)
 {
   Framerate = _Framerate;
-  FrameTime = 1.0f / _Framerate;
-  TimePassed = 0;
+  std::fill(Priv->TimePassed, Priv->TimePassed + 3, 0.0f);
   OUT_INFO(TEXT("FRAMERATE SET TO: %f"),Framerate);
 }
 
+void AVisionActor::SetResolution(const uint32 _Width, const uint32 _Height)
+{
+  Width = _Width;
+  Height = _Height;
+  ResolutionChanged = true;
+  OUT_INFO(TEXT("RESOLUTION SET TO: %dx%d"), Width, Height);
+}
+
+void AVisionActor::ApplyResolution()
+{
+  ResolutionChanged = false;
+
+  // Reinitializing the render targets with the new size and the same format
+  Color->TextureTarget->InitCustomFormat(Width, Height, PF_B8G8R8A8, true);
+  Depth->TextureTarget->InitCustomFormat(Width, Height, PF_R16F, true);
+  Object->TextureTarget->InitCustomFormat(Width, Height, PF_B8G8R8A8, true);
+  GetCameraComponent()->AspectRatio = Width / (float)Height;
+
+  // No processing thread is running when this is called, arrays keep their memory if they get smaller
+  ImageColor.SetNumUninitialized(Width * Height, false);
+  ImageDepth.SetNumUninitialized(Width * Height, false);
+  ImageObject.SetNumUninitialized(Width * Height, false);
+
+  // The packet buffer only takes new slabs from the pool if the packet does not fit anymore
+  Priv->Buffer->SetResolution(Width, Height);
+}
+
 void AVisionActor::Pause(const bool _Pause)
 {
   Paused = _Pause;
@@ -288,41 +899,43 @@ void AVisionActor::ShowFlagsVertexColor(FEngineShowFlags &ShowFlags) const
   ShowFlags.SetPostProcessing(false);
   ShowFlags.SetHMDDistortion(false);
   ShowFlags.SetTonemapper(false); // This won't take effect here
+  ShowFlags.SetAntiAliasing(false); // Blended edges would create colors that belong to no object
 
   GVertexColorViewMode = EVertexColorViewMode::Color;
 }
 
-void AVisionActor::ReadImage(UTextureRenderTarget2D *RenderTarget, TArray<FFloat16Color> &ImageData) const
+void AVisionActor::ToColorImage(const TArray<FColor> &ImageData, uint8 *Bytes) const
 {
-  FTextureRenderTargetResource *RenderTargetResource = RenderTarget->GameThread_GetRenderTargetResource();
-  RenderTargetResource->ReadFloat16Pixels(ImageData);
+  // Drops the alpha channel
+  static const ImageConversion::Converter Convert = ImageConversion::Find(ImageConversion::FormatBGRA8, ImageConversion::FormatBGR8);
+  Convert(ImageData.GetData(), Bytes, ImageData.Num());
+  return;
 }
 
-void AVisionActor::ToColorImage(const TArray<FFloat16Color> &ImageData, uint8 *Bytes) const
+void AVisionActor::ToDepthImage(const TArray<FFloat16> &ImageData, const uint32 Format, uint8 *Bytes) const
 {
-  const FFloat16Color *itI = ImageData.GetData();
-  uint8_t *itO = Bytes;
-
-  // Converts Float colors to bytes
-  for(size_t i = 0; i < ImageData.Num(); ++i, ++itI, ++itO)
+  ImageConversion::PixelFormat Output;
+  switch(Format)
   {
-    *itO = (uint8_t)std::round((float)itI->B * 255.f);
-    *++itO = (uint8_t)std::round((float)itI->G * 255.f);
-    *++itO = (uint8_t)std::round((float)itI->R * 255.f);
+  case PacketBuffer::DepthFormatFloat32:
+    Output = ImageConversion::FormatFloat32;
+    break;
+  case PacketBuffer::DepthFormatUInt16:
+    Output = ImageConversion::FormatUInt16;
+    break;
+  default:
+    // Just copies the encoded Float16 values
+    Output = ImageConversion::FormatFloat16;
+    break;
   }
+  ImageConversion::Find(ImageConversion::FormatFloat16, Output)(ImageData.GetData(), Bytes, ImageData.Num());
   return;
 }
 
-void AVisionActor::ToDepthImage(const TArray<FFloat16Color> &ImageData, uint8 *Bytes) const
+void AVisionActor::ToLabelImage(const TArray<FColor> &ImageData, const TArray<uint32> &Labels, uint8 *Bytes) const
 {
-  const FFloat16Color *itI = ImageData.GetData();
-  uint16_t *itO = reinterpret_cast<uint16_t *>(Bytes);
-
-  // Just copies the encoded Float16 values
-  for(size_t i = 0; i < ImageData.Num(); ++i, ++itI, ++itO)
-  {
-    *itO = itI->R.Encoded;
-  }
+  // The id is stored in the RGB channels, unknown ids are mapped to 0
+  ImageConversion::DecodeLabels(ImageData.GetData(), Labels.GetData(), Labels.Num(), reinterpret_cast<uint32 *>(Bytes), ImageData.Num());
   return;
 }
 
@@ -340,6 +953,18 @@ void AVisionActor::StoreImage(const uint8 *ImageData, const uint32 Size, const c
  */
 void AVisionActor::GenerateColors(const uint32_t NumberOfColors)
 {
+  // Ids are directly encoded in the 24 bits of the color, previously generated ids stay the same
+  if(EncodeObjectIds)
+  {
+    const uint32_t NumberOfIds = std::min<uint32_t>(std::max<uint32_t>(NumberOfColors, 2), 1 << 24);
+    ObjectColors.Reset(NumberOfIds);
+    for(uint32_t Id = 0; Id < NumberOfIds; ++Id)
+    {
+      ObjectColors.Add(FColor((uint8)(Id >> 16), (uint8)(Id >> 8), (uint8)Id));
+    }
+    return;
+  }
+
   const int32_t MaxHue = 50;
   // It shifts the next Hue value used, so that colors next to each other are not very similar. This is just important for humans
   const int32_t ShiftHue = 21;
@@ -370,7 +995,7 @@ void AVisionActor::GenerateColors(const uint32_t NumberOfColors)
   const float StepSat = (1.0f - MinSat) / std::max(1.0f, SatCount - 1.0f);
   const float StepVal = (1.0f - MinVal) / std::max(1.0f, ValCount - 1.0f);
 
-  ObjectColors.Reserve(SatCount * ValCount * HueCount);
+  ObjectColors.Reset(SatCount * ValCount * HueCount);
   OUT_INFO(TEXT("Generating %d colors."), SatCount * ValCount * HueCount);
 
   FLinearColor HSVColor;
@@ -384,103 +1009,220 @@ void AVisionActor::GenerateColors(const uint32_t NumberOfColors)
       {
         HSVColor.R = ((h * ShiftHue) % MaxHue) * StepHue;
         ObjectColors.Add(HSVColor.HSVToLinearRGB().ToFColor(false));
-        OUT_INFO(TEXT("Added color %d: %d %d %d"), ObjectColors.Num(), ObjectColors.Last().R, ObjectColors.Last().G, ObjectColors.Last().B);
       }
     }
   }
 }
 
-bool AVisionActor::ColorObject(AActor *Actor, const FString &name)
+bool AVisionActor::AddObject(AActor *Actor)
 {
-  const FColor &ObjectColor = ObjectColors[ObjectToColor[name]];
-  TArray<UMeshComponent *> PaintableComponents;
-  Actor->GetComponents<UMeshComponent>(PaintableComponents);
-
-  for(auto MeshComponent : PaintableComponents)
+  // Only actors with static meshes are visible in the object image
+  TArray<UStaticMeshComponent *> Components;
+  Actor->GetComponents<UStaticMeshComponent>(Components);
+  if(Components.Num() == 0)
   {
-    if(MeshComponent == nullptr)
-      continue;
+    return false;
+  }
 
-    if(UStaticMeshComponent *StaticMeshComponent = Cast<UStaticMeshComponent>(MeshComponent))
+  const FString ActorName = Actor->GetName();
+  if(!ObjectToColor.Contains(ActorName))
+  {
+    // Reuse colors of destroyed objects first, generate a bigger set of colors if all are used
+    uint32 ColorIndex;
+    if(FreeColors.Num() > 0)
+    {
+      ColorIndex = FreeColors.Pop(false);
+    }
+    else
     {
-      if(UStaticMesh *StaticMesh = StaticMeshComponent->GetStaticMesh())
+      if(ColorsUsed >= (uint32)ObjectColors.Num())
       {
-        uint32 PaintingMeshLODIndex = 0;
-        uint32 NumLODLevel = StaticMesh->RenderData->LODResources.Num();
-        //check(NumLODLevel == 1);
-        FStaticMeshLODResources &LODModel = StaticMesh->RenderData->LODResources[PaintingMeshLODIndex];
-        FStaticMeshComponentLODInfo *InstanceMeshLODInfo = NULL;
-
-        // PaintingMeshLODIndex + 1 is the minimum requirement, enlarge if not satisfied
-        StaticMeshComponent->SetLODDataCount(PaintingMeshLODIndex + 1, StaticMeshComponent->LODData.Num());
-        InstanceMeshLODInfo = &StaticMeshComponent->LODData[PaintingMeshLODIndex];
-
+        OUT_WARN(TEXT("All %d colors are used, generating new colors."), ObjectColors.Num());
+        GenerateColors(ObjectColors.Num() * 2);
+        if(ColorsUsed >= (uint32)ObjectColors.Num())
         {
-          InstanceMeshLODInfo->OverrideVertexColors = new FColorVertexBuffer;
-
-          FColor FillColor = FColor(255, 255, 255, 255);
-          InstanceMeshLODInfo->OverrideVertexColors->InitFromSingleColor(FColor::White, LODModel.GetNumVertices());
+          OUT_ERROR(TEXT("No ids left for object %s."), *ActorName);
+          return false;
         }
-
-        uint32 NumVertices = LODModel.GetNumVertices();
-        //check(InstanceMeshLODInfo->OverrideVertexColors);
-        //check(NumVertices <= InstanceMeshLODInfo->OverrideVertexColors->GetNumVertices());
-
-        for(uint32 ColorIndex = 0; ColorIndex < NumVertices; ++ColorIndex)
+        if(!EncodeObjectIds)
         {
-          uint32 NumOverrideVertexColors = InstanceMeshLODInfo->OverrideVertexColors->GetNumVertices();
-          uint32 NumPaintedVertices = InstanceMeshLODInfo->PaintedVertices.Num();
-          InstanceMeshLODInfo->OverrideVertexColors->VertexColor(ColorIndex) = ObjectColor;
+          RecolorAllObjects();
         }
-        BeginInitResource(InstanceMeshLODInfo->OverrideVertexColors);
-        StaticMeshComponent->MarkRenderStateDirty();
       }
+      ColorIndex = ColorsUsed++;
+    }
+    ObjectToColor.Add(ActorName, ColorIndex);
+
+    if((uint32)ObjectNames.Num() <= ColorIndex)
+    {
+      ObjectNames.SetNum(ColorIndex + 1);
+      IdToLabel.SetNumZeroed(ColorIndex + 1);
     }
+    ObjectNames[ColorIndex] = ActorName;
+    IdToLabel[ColorIndex] = ColorIndex;
   }
+
+  ColorObject(Actor, ActorName);
+  Actor->OnEndPlay.AddUniqueDynamic(this, &AVisionActor::OnActorEndPlay);
   return true;
 }
 
-bool AVisionActor::ColorAllObjects()
+void AVisionActor::RemoveObject(AActor *Actor)
 {
-  uint32_t NumberOfActors = 0;
+  Actor->OnEndPlay.RemoveDynamic(this, &AVisionActor::OnActorEndPlay);
+  UncolorObject(Actor);
 
-  for(TActorIterator<AActor> ActItr(GetWorld()); ActItr; ++ActItr)
+  uint32 ColorIndex;
+  if(ObjectToColor.RemoveAndCopyValue(Actor->GetName(), ColorIndex))
+  {
+    ObjectNames[ColorIndex].Empty();
+    IdToLabel[ColorIndex] = 0;
+    FreeColors.Add(ColorIndex);
+  }
+}
+
+bool AVisionActor::ColorObject(AActor *Actor, const FString &name)
+{
+  const uint32 ColorIndex = ObjectToColor[name];
+  const FColor &ObjectColor = ObjectColors[ColorIndex];
+  TArray<UStaticMeshComponent *> StaticMeshComponents;
+  Actor->GetComponents<UStaticMeshComponent>(StaticMeshComponents);
+
+  for(UStaticMeshComponent *StaticMeshComponent : StaticMeshComponents)
   {
-    ++NumberOfActors;
-    FString ActorName = ActItr->GetName();
-    OUT_INFO(TEXT("Actor with name: %s."), *ActorName);
+    UStaticMesh *StaticMesh = StaticMeshComponent->GetStaticMesh();
+    if(!StaticMesh || !StaticMesh->RenderData || StaticMesh->RenderData->LODResources.Num() == 0)
+    {
+      continue;
+    }
+
+    uint32 PaintingMeshLODIndex = 0;
+    FStaticMeshLODResources &LODModel = StaticMesh->RenderData->LODResources[PaintingMeshLODIndex];
+
+    // Release the buffer of a previous coloring before assigning a new one
+    Priv->DetachVertexColors(StaticMeshComponent);
+
+    // PaintingMeshLODIndex + 1 is the minimum requirement, enlarge if not satisfied
+    StaticMeshComponent->SetLODDataCount(PaintingMeshLODIndex + 1, StaticMeshComponent->LODData.Num());
+    FStaticMeshComponentLODInfo *InstanceMeshLODInfo = &StaticMeshComponent->LODData[PaintingMeshLODIndex];
+
+    // All components of the same mesh and color share one buffer
+    const PrivateData::VertexColorKey Key(StaticMesh, ColorIndex);
+    InstanceMeshLODInfo->OverrideVertexColors = Priv->AcquireVertexColors(Key, ObjectColor, LODModel.GetNumVertices());
+    Priv->ColoredComponents.Add(StaticMeshComponent, Key);
+    StaticMeshComponent->MarkRenderStateDirty();
   }
-  
+  return true;
+}
+
+void AVisionActor::UncolorObject(AActor *Actor)
+{
+  TArray<UStaticMeshComponent *> StaticMeshComponents;
+  Actor->GetComponents<UStaticMeshComponent>(StaticMeshComponents);
+
+  for(UStaticMeshComponent *StaticMeshComponent : StaticMeshComponents)
+  {
+    Priv->DetachVertexColors(StaticMeshComponent);
+  }
+}
+
+bool AVisionActor::ColorAllObjects()
+{
+  const uint32_t NumberOfActors = GetWorld()->GetActorCount();
   OUT_INFO(TEXT("Found %d Actors."), NumberOfActors);
   GenerateColors(NumberOfActors * 2);
 
+  // Id 0 is reserved for pixels without an object
+  ColorsUsed = EncodeObjectIds ? 1 : 0;
+  ObjectNames.SetNum(ColorsUsed);
+  IdToLabel.SetNumZeroed(ColorsUsed);
+
+  uint32_t NumberOfObjects = 0;
   for(TActorIterator<AActor> ActItr(GetWorld()); ActItr; ++ActItr)
   {
-    FString ActorName = ActItr->GetName();
-    if(!ObjectToColor.Contains(ActorName))
+    if(AddObject(*ActItr))
     {
-      check(ColorsUsed < (uint32)ObjectColors.Num());
-      ObjectToColor.Add(ActorName, ColorsUsed);
-      OUT_INFO(TEXT("Adding color %d for object %s."), ColorsUsed, *ActorName);
+      ++NumberOfObjects;
+    }
+  }
+  OUT_INFO(TEXT("Colored %d objects."), NumberOfObjects);
+  return true;
+}
+
+void AVisionActor::RecolorAllObjects()
+{
+  Priv->DetachDestroyedComponents();
+  TArray<TWeakObjectPtr<UStaticMeshComponent>> Components;
+  Priv->ColoredComponents.GetKeys(Components);
 
-      ++ColorsUsed;
+  TSet<AActor *> Actors;
+  for(const TWeakObjectPtr<UStaticMeshComponent> &Weak : Components)
+  {
+    UStaticMeshComponent *Component = Weak.Get();
+    AActor *Owner = Component ? Component->GetOwner() : nullptr;
+    if(Owner)
+    {
+      Actors.Add(Owner);
     }
+  }
 
-    OUT_INFO(TEXT("Coloring object %s."), *ActorName);
-    ColorObject(*ActItr, ActorName);
+  // Uncolor everything first, otherwise shared buffers with outdated colors would be reused
+  for(AActor *Actor : Actors)
+  {
+    UncolorObject(Actor);
   }
-  return true;
+  for(AActor *Actor : Actors)
+  {
+    ColorObject(Actor, Actor->GetName());
+  }
+}
+
+void AVisionActor::OnActorSpawned(AActor *Actor)
+{
+  AddObject(Actor);
+}
+
+void AVisionActor::OnActorEndPlay(AActor *Actor, EEndPlayReason::Type EndPlayReason)
+{
+  RemoveObject(Actor);
+}
+
+void AVisionActor::OnPreGarbageCollect()
+{
+  Priv->DetachDestroyedComponents();
 }
 
 void AVisionActor::ProcessColor()
 {
+  ThreadTuning::Apply(TEXT("UVColor"), Priv->ProcessingSettings);
   while(true)
   {
     std::unique_lock<std::mutex> WaitLock(Priv->WaitColor);
     Priv->CVColor.wait(WaitLock, [this] {return Priv->DoColor; });
     Priv->DoColor = false;
     if(!this->Running) break;
-    ToColorImage(ImageColor, Priv->Buffer->Color);
+    Priv->TimingColor.Woken();
+    const PacketBuffer::PacketHeader *Header = Priv->Buffer->HeaderWrite;
+    const TArray<FColor> *Input = &ImageColor;
+    if(PrivateData::IsReduced(Header))
+    {
+      Priv->ReducedColor.SetNumUninitialized(Header->Width * Header->Height, false);
+      ImageResampling::Box(ImageColor.GetData(), Header->CaptureWidth, Header->Region.X, Header->Region.Y, Header->Width, Header->Height,
+                           Header->Region.Level, Priv->ReducedColor.GetData());
+      Input = &Priv->ReducedColor;
+    }
+
+    if(Header->FrameType == PacketBuffer::FrameComplete)
+    {
+      ToColorImage(*Input, Priv->Buffer->Color);
+      Priv->SizeDataColor = Priv->Buffer->SizeRGB;
+    }
+    else
+    {
+      ToColorImage(*Input, Priv->DeltaColor.Prepare(Priv->Buffer->SizeRGB));
+      Priv->SizeDataColor = Priv->DeltaColor.Encode(PrivateData::IsKeyframe(Header, PacketBuffer::StreamColor), Header->Width, Header->Height, 3,
+                                                    PacketBuffer::DeltaTileSize, Priv->Buffer->Color);
+    }
 
     Priv->DoneColor = true;
     Priv->CVDone.notify_one();
@@ -489,13 +1231,61 @@ void AVisionActor::ProcessColor()
 
 void AVisionActor::ProcessDepth()
 {
+  ThreadTuning::Apply(TEXT("UVDepth"), Priv->ProcessingSettings);
   while(true)
   {
     std::unique_lock<std::mutex> WaitLock(Priv->WaitDepth);
     Priv->CVDepth.wait(WaitLock, [this] {return Priv->DoDepth; });
     Priv->DoDepth = false;
     if(!this->Running) break;
-    ToDepthImage(ImageDepth, Priv->Buffer->Depth);
+    Priv->TimingDepth.Woken();
+    const PacketBuffer::PacketHeader *Header = Priv->Buffer->HeaderWrite;
+    Priv->SizeDataDepth = 0;
+    Priv->SizeDataNormals = 0;
+
+    // The depth thread also completes packets without a depth image
+    if(Header->Streams & PacketBuffer::StreamDepth)
+    {
+      const bool Keyframe = PrivateData::IsKeyframe(Header, PacketBuffer::StreamDepth);
+      const TArray<FFloat16> *Input = &ImageDepth;
+      if(PrivateData::IsReduced(Header))
+      {
+        Priv->ReducedDepth.SetNumUninitialized(Header->Width * Header->Height, false);
+        ImageResampling::MinDepth(ImageDepth.GetData(), Header->CaptureWidth, Header->Region.X, Header->Region.Y, Header->Width, Header->Height,
+                                  Header->Region.Level, Priv->ReducedDepth.GetData());
+        Input = &Priv->ReducedDepth;
+      }
+
+      if(Header->FrameType == PacketBuffer::FrameComplete)
+      {
+        ToDepthImage(*Input, Header->FormatDepth, Priv->Buffer->Depth);
+        Priv->SizeDataDepth = Priv->Buffer->SizeDepth;
+      }
+      else
+      {
+        const uint32 BytesPerPixel = Priv->Buffer->SizeDepth / (Header->Width * Header->Height);
+        ToDepthImage(*Input, Header->FormatDepth, Priv->DeltaDepth.Prepare(Priv->Buffer->SizeDepth));
+        Priv->SizeDataDepth = Priv->DeltaDepth.Encode(Keyframe, Header->Width, Header->Height, BytesPerPixel,
+                                                      PacketBuffer::DeltaTileSize, Priv->Buffer->Depth);
+      }
+
+      // Normals are computed from the depth image while the other threads are still working
+      Priv->SizeDataNormals = Priv->Buffer->SizeNormals;
+      if(Header->FormatNormals != PacketBuffer::NormalsFormatNone)
+      {
+        if(Header->FrameType == PacketBuffer::FrameComplete)
+        {
+          Priv->Normals.Compute(Input->GetData(), *Header, Priv->Buffer->Normals);
+        }
+        else
+        {
+          const uint32 BytesPerPixel = Priv->Buffer->SizeNormals / (Header->Width * Header->Height);
+          Priv->Normals.Compute(Input->GetData(), *Header, Priv->DeltaNormals.Prepare(Priv->Buffer->SizeNormals));
+          Priv->SizeDataNormals = Priv->DeltaNormals.Encode(Keyframe, Header->Width, Header->Height, BytesPerPixel,
+                                                            PacketBuffer::DeltaTileSize, Priv->Buffer->Normals);
+        }
+      }
+    }
 
     // Wait for both other processing threads to be done.
     std::unique_lock<std::mutex> WaitDoneLock(Priv->WaitDone);
@@ -504,20 +1294,78 @@ void AVisionActor::ProcessDepth()
     Priv->DoneColor = false;
     Priv->DoneObject = false;
 
-    // Complete Buffer
-    Priv->Buffer->DoneWriting();
+    // Remove the unused space between the delta encoded images
+    if(Header->FrameType != PacketBuffer::FrameComplete)
+    {
+      Priv->Buffer->CompactImages(Priv->SizeDataColor, Priv->SizeDataDepth, Priv->SizeDataObject, Priv->SizeDataNormals);
+    }
+
+    if(Priv->History.IsValid())
+    {
+      Priv->History->Add(reinterpret_cast<const uint8 *>(Priv->Buffer->HeaderWrite), Priv->Buffer->HeaderWrite->Size);
+    }
+
+    // Complete Buffer, the packet is shared by the server, the multicast sender and the recorder without copying it
+    const SlabPool::SharedSlab Packet = Priv->Buffer->DoneWriting();
+    if(Priv->Multicast.IsValid())
+    {
+      Priv->Multicast->Submit(Packet);
+    }
+    if(Priv->Recorder.IsOpen())
+    {
+      Priv->Recorder.Submit(Packet);
+    }
+    {
+      std::lock_guard<std::mutex> Lock(Priv->WaitCredit);
+      Priv->FramePending = false;
+    }
+    Priv->CVCredit.notify_one();
   }
 }
 
 void AVisionActor::ProcessObject()
 {
+  ThreadTuning::Apply(TEXT("UVObject"), Priv->ProcessingSettings);
   while(true)
   {
     std::unique_lock<std::mutex> WaitLock(Priv->WaitObject);
     Priv->CVObject.wait(WaitLock, [this] {return Priv->DoObject; });
     Priv->DoObject = false;
     if(!this->Running) break;
-    ToColorImage(ImageObject, Priv->Buffer->Object);
+    Priv->TimingObject.Woken();
+    const PacketBuffer::PacketHeader *Header = Priv->Buffer->HeaderWrite;
+    const uint32 ImageWidth = Header->Width;
+    const uint32 ImageHeight = Header->Height;
+
+    const TArray<FColor> *Input = &ImageObject;
+    if(PrivateData::IsReduced(Header))
+    {
+      Priv->ReducedObject.SetNumUninitialized(ImageWidth * ImageHeight, false);
+      ImageResampling::Nearest(ImageObject.GetData(), Header->CaptureWidth, Header->Region.X, Header->Region.Y, ImageWidth, ImageHeight,
+                               Header->Region.Level, Priv->ReducedObject.GetData());
+      Input = &Priv->ReducedObject;
+    }
+
+    // Delta frames need the complete image for the statistics, so it is converted into the encoder first
+    const bool Delta = Header->FrameType != PacketBuffer::FrameComplete;
+    uint8 *Output = Delta ? Priv->DeltaObject.Prepare(Priv->Buffer->SizeObject) : Priv->Buffer->Object;
+    if(EncodeObjectIds)
+    {
+      ToLabelImage(*Input, Priv->FrameIdToLabel, Output);
+      ObjectStatistics::FromLabels(reinterpret_cast<const uint32 *>(Output), ImageWidth, ImageHeight, Priv->ObjectStats);
+    }
+    else
+    {
+      ToColorImage(*Input, Output);
+      ObjectStatistics::FromColors(Output, ImageWidth, ImageHeight, Priv->FrameColors, Priv->ObjectStats);
+    }
+    Priv->SizeDataObject = Priv->Buffer->SizeObject;
+    if(Delta)
+    {
+      Priv->SizeDataObject = Priv->DeltaObject.Encode(PrivateData::IsKeyframe(Header, PacketBuffer::StreamObject), ImageWidth, ImageHeight,
+                                                      EncodeObjectIds ? sizeof(uint32) : 3, PacketBuffer::DeltaTileSize, Priv->Buffer->Object);
+    }
+    Priv->Buffer->AppendObjectStats(Priv->ObjectStats);
 
     Priv->DoneObject = true;
     Priv->CVDone.notify_one();
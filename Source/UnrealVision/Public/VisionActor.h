@@ -30,6 +30,9 @@ public:
 
   // Change the framerate on the fly
   void SetFramerate(const float _Framerate);
+
+  // Change the resolution on the fly, it is applied between two frames
+  void SetResolution(const uint32 _Width, const uint32 _Height);
   
   // Pause/resume camera
   void Pause(const bool _Pause = true);
@@ -43,10 +46,57 @@ public:
   uint32 Height;
   UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
   float Framerate;
+  // Framerates of the single images, 0 uses Framerate. Only the images that are due are captured.
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  float ColorFramerate;
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  float DepthFramerate;
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  float ObjectFramerate;
   UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
   float FieldOfView;
   UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
   int32 ServerPort;
+  // Encode dense object ids in the vertex colors and send a label image instead of colors
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  bool EncodeObjectIds;
+  // Number of packets kept for clients requesting past frames, 0 disables the history
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  int32 HistoryFrames;
+  // Memory for the history in MiB, older packets are dropped if it is full
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  int32 HistoryMemory;
+  // Advance the simulation in fixed steps of 1 / Framerate along the trajectory and capture every step
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  bool BatchMode;
+  // Camera poses for the batch mode, one "x y z qx qy qz qw" per line in meters and ROS coordinates
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  FString TrajectoryFile;
+  // All packets are written to this file if set
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  FString RecordingFile;
+  // Packets are also sent to this UDP multicast group (e.g. 239.0.0.1) if set
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  FString MulticastGroup;
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  int32 MulticastPort;
+  // Number of fragments per parity fragment for restoring lost fragments, 0 disables them
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  int32 MulticastBlockSize;
+  // Cores for the image processing threads and for the sending threads, e.g. "4-6" or "7", empty for any core
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  FString ProcessingCores;
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  FString ServerCores;
+  // Priority of these threads, 0 keeps the default. On Linux 1 to 99 selects real-time scheduling.
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  int32 ThreadPriority;
+  // Keeps the game and render thread off the cores of the processing and sending threads
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  bool ReserveCores;
+  // Logs the wake-up latency and the jitter of the processing and sending threads
+  UPROPERTY(EditAnywhere, Category = "RGB-D Settings")
+  bool MeasureThreadTiming;
 
 private:
   // Private data container
@@ -60,25 +110,46 @@ private:
 
   UMaterialInstanceDynamic *MaterialDepthInstance;
 
-  float FrameTime, TimePassed;
-  TArray<FFloat16Color> ImageColor, ImageDepth, ImageObject;
+  TArray<FColor> ImageColor, ImageObject;
+  TArray<FFloat16> ImageDepth;
   TArray<uint8> DataColor, DataDepth, DataObject;
   TArray<FColor> ObjectColors;
   TMap<FString, uint32> ObjectToColor;
+  // Names of the objects and lookup table from encoded id to label, indexed by the color index
+  TArray<FString> ObjectNames;
+  TArray<uint32> IdToLabel;
+  // Colors of destroyed objects that can be reused
+  TArray<uint32> FreeColors;
   uint32 ColorsUsed;
-  bool Running, Paused;
+  bool Running, Paused, ResolutionChanged;
+  FDelegateHandle ActorSpawnedHandle, PreGarbageCollectHandle;
 
+  void ApplyResolution();
+  bool LoadTrajectory(const FString &Path);
+  void TickBatch();
+  uint32 DueStreams(const float DeltaTime);
+  void CaptureStreams(const uint32 Streams);
+  void RequestFrame();
+  bool HandOverFrame(const bool Wait);
   void ShowFlagsBasicSetting(FEngineShowFlags &ShowFlags) const;
   void ShowFlagsLit(FEngineShowFlags &ShowFlags) const;
   void ShowFlagsPostProcess(FEngineShowFlags &ShowFlags) const;
   void ShowFlagsVertexColor(FEngineShowFlags &ShowFlags) const;
-  void ReadImage(UTextureRenderTarget2D *RenderTarget, TArray<FFloat16Color> &ImageData) const;
-  void ToColorImage(const TArray<FFloat16Color> &ImageData, uint8 *Bytes) const;
-  void ToDepthImage(const TArray<FFloat16Color> &ImageData, uint8 *Bytes) const;
+  void ToColorImage(const TArray<FColor> &ImageData, uint8 *Bytes) const;
+  void ToDepthImage(const TArray<FFloat16> &ImageData, const uint32 Format, uint8 *Bytes) const;
+  void ToLabelImage(const TArray<FColor> &ImageData, const TArray<uint32> &Labels, uint8 *Bytes) const;
   void StoreImage(const uint8 *ImageData, const uint32 Size, const char *Name) const;
   void GenerateColors(const uint32_t NumberOfColors);
+  bool AddObject(AActor *Actor);
+  void RemoveObject(AActor *Actor);
   bool ColorObject(AActor *Actor, const FString &name);
+  void UncolorObject(AActor *Actor);
   bool ColorAllObjects();
+  void RecolorAllObjects();
+  void OnActorSpawned(AActor *Actor);
+  UFUNCTION()
+  void OnActorEndPlay(AActor *Actor, EEndPlayReason::Type EndPlayReason);
+  void OnPreGarbageCollect();
   void ProcessColor();
   void ProcessDepth();
   void ProcessObject();
@@ -21,6 +21,12 @@ public class UnrealVision : ModuleRules
 				// ... add other private include paths required here ...
 			}
 			);
+
+		// The io_uring sender needs the native handle of the client socket
+		if (Target.Platform == UnrealTargetPlatform.Linux)
+		{
+			PrivateIncludePaths.Add("Runtime/Sockets/Private");
+		}
 			
 		
 		PublicDependencyModuleNames.AddRange(